@@ -13,6 +13,7 @@ using System.Windows.Media.Imaging;
 using System.Windows.Navigation;
 using System.Windows.Shapes;
 using System.IO;
+using System.Diagnostics;
 using HidSharp;
 using IntelHexFormatReader;
 using IntelHexFormatReader.Model;
@@ -26,6 +27,38 @@ namespace KeymapDownloader
     {
         HidDevice device;
 
+        /// <summary>
+        /// 未压缩的配列长度
+        /// </summary>
+        const int PlainSize = 1024;
+        /// <summary>
+        /// 配列文件的最大长度，32 层
+        /// </summary>
+        const int MaxFileSize = 0x2000;
+        /// <summary>
+        /// 固件中保存配列的空间，与 keymap_storage.c 中的 KEYMAP_IMAGE_SIZE 相同：
+        /// 一页 1024 字节减去 8 字节的头部和 4 字节的 CRC
+        /// </summary>
+        const int ImageSize = 1024 - 8 - 4;
+        const int LayerOffset = 0x55;
+
+        const int PacketSize = 60;
+        const int PacketCount = PlainSize / PacketSize;
+        /// <summary>
+        /// 同时发出的包数
+        /// </summary>
+        const int Window = 4;
+        /// <summary>
+        /// 固件还在写入上一次的配列时拒绝开始，等待后重发（毫秒）
+        /// </summary>
+        const int BusyDelay = 50;
+        /// <summary>
+        /// 固件只接收第一个未确认的包之后这个范围内的包
+        /// </summary>
+        const int DeviceWindow = 6;
+        const byte PacketBegin = 0xff;
+        const byte KeymapAck = 0xc2;
+
         public MainWindow()
         {
             InitializeComponent();
@@ -70,7 +103,9 @@ namespace KeymapDownloader
         private void Download_Click(object sender, RoutedEventArgs e)
         {
             var path = Path.Text;
-            byte[] binary = new Byte[1024];
+            byte[] binary = new Byte[PlainSize];
+            byte[] source = new Byte[MaxFileSize];
+            int length = 0;
 
             HidStream hidStream = device.Open();
 
@@ -85,44 +120,192 @@ namespace KeymapDownloader
                 {
                     using (var stream = File.Open(path, FileMode.Open))
                     {
-                        stream.Read(binary, 0, 1024);
+                        length = stream.Read(source, 0, MaxFileSize);
                     }
                 }
                 else
                 {
-                    HexFileReader reader = new HexFileReader(path, 1024);
+                    HexFileReader reader = new HexFileReader(path, MaxFileSize);
                     MemoryBlock memoryRepresentation = reader.Parse();
 
                     int index = 0;
                     foreach (var item in memoryRepresentation.Cells)
                     {
-                        binary[index++] = item.Value;
-                        if (index == 1024)
+                        source[index++] = item.Value;
+                        if (item.Modified)
+                        {
+                            length = index;
+                        }
+                        if (index == MaxFileSize)
                         {
                             break;
                         }
                     }
                 }
-                // 第一个Byte为0x55代表启用此Keymap
-                binary[0] = 0x55;
+
+                if (length <= PlainSize)
+                {
+                    Array.Copy(source, binary, PlainSize);
+                    // 第一个Byte为0x55代表启用此Keymap
+                    binary[0] = 0x55;
+                }
+                else
+                {
+                    // 超过 8 层的配列压缩后下载
+                    var sparse = SparseEncode(source, length);
+                    if (sparse.Length > ImageSize)
+                    {
+                        lbl_status.Text = "配列文件过大";
+                        return;
+                    }
+                    Array.Copy(sparse, binary, sparse.Length);
+                }
             }
 
             try
             {
-                byte[] packet = new byte[60];
+                var watch = Stopwatch.StartNew();
+                SendKeymap(hidStream, binary);
+                lbl_status.Text = string.Format("完成，用时 {0} ms", watch.ElapsedMilliseconds);
+            }
+            catch (Exception exp)
+            {
+                lbl_status.Text = exp.Message;
+            }
+        }
+
+        /// <summary>
+        /// 下载配列。一次发出多个包，根据固件返回的已接收列表重发缺少的包
+        /// </summary>
+        void SendKeymap(HidStream stream, byte[] binary)
+        {
+            var session = (ushort)new Random().Next(1, 0x10000);
+            uint received;
+            int retryCount = 5;
 
-                for (int i = 0; i < (binary.Length / 60); i++)
+            stream.ReadTimeout = 500;
+
+            // 开始下载，固件擦除配列
+            byte[] begin = new byte[PacketSize];
+            begin[0] = (byte)session;
+            begin[1] = (byte)(session >> 8);
+            while (true)
+            {
+                SendPacket(stream, PacketBegin, begin);
+                try
+                {
+                    if (ReadStatus(stream, session, out received))
+                    {
+                        break;
+                    }
+                    // 应答中是上一次的编号：固件忙
+                    System.Threading.Thread.Sleep(BusyDelay);
+                }
+                catch (TimeoutException)
                 {
-                    Array.Copy(binary, i * 60, packet, 0, 60);
-                    SendPacket(hidStream, (uint)i, packet);
+                }
+                if (retryCount-- == 0)
+                {
+                    throw new Exception("发送重试次数达到上限");
                 }
             }
-            catch (Exception exp)
+
+            uint all = (1u << PacketCount) - 1;
+            uint acked = 0;
+            var inflight = new Queue<int>();
+            byte[] packet = new byte[PacketSize];
+
+            retryCount = 5;
+            while (acked != all)
             {
-                lbl_status.Text = exp.Message;
+                int first = 0;
+                while ((acked & (1u << first)) != 0)
+                {
+                    first++;
+                }
+                for (int i = first; i < PacketCount && i < first + DeviceWindow && inflight.Count < Window; i++)
+                {
+                    if ((acked & (1u << i)) == 0 && !inflight.Contains(i))
+                    {
+                        Array.Copy(binary, i * PacketSize, packet, 0, PacketSize);
+                        SendPacket(stream, (uint)i, packet);
+                        inflight.Enqueue(i);
+                    }
+                }
+
+                try
+                {
+                    if (ReadStatus(stream, session, out received))
+                    {
+                        if ((received & ~acked) != 0)
+                        {
+                            retryCount = 5;
+                        }
+                        acked = received;
+                    }
+                    // 应答按发送的顺序返回，最早发出的包已经处理过，没有接收的下一轮重发
+                    inflight.Dequeue();
+                }
+                catch (TimeoutException)
+                {
+                    // 应答丢失
+                    inflight.Clear();
+                    if (retryCount-- == 0)
+                    {
+                        throw new Exception("发送重试次数达到上限");
+                    }
+                }
+            }
+        }
+
+        /// <summary>
+        /// 读取固件返回的下载状态
+        /// </summary>
+        /// <returns>是否为本次下载的状态</returns>
+        static bool ReadStatus(HidStream stream, ushort session, out uint received)
+        {
+            var ret = stream.Read();
+
+            received = 0;
+            if (ret[1] != KeymapAck || (ushort)(ret[2] | ret[3] << 8) != session)
+            {
+                return false;
             }
+            received = BitConverter.ToUInt32(ret, 4);
+            return true;
+        }
+
+        /// <summary>
+        /// 压缩配列，格式见固件中的 keymap_storage.c
+        /// </summary>
+        static byte[] SparseEncode(byte[] source, int length)
+        {
+            var output = new List<byte>(source.Take(LayerOffset));
+            // 第一个Byte为0x5A代表启用压缩格式的Keymap
+            output[0] = 0x5a;
 
-            lbl_status.Text = "完成";
+            int i = LayerOffset;
+            while (i < length)
+            {
+                int run = 1;
+                while (i + run < length && source[i + run] == source[i] && run < 255)
+                {
+                    run++;
+                }
+                if (run >= 3 || source[i] == 0xff)
+                {
+                    output.Add(0xff);
+                    output.Add(source[i]);
+                    output.Add((byte)run);
+                    i += run;
+                }
+                else
+                {
+                    output.Add(source[i++]);
+                }
+            }
+            output.AddRange(new byte[] { 0xff, 0x00, 0x00 });
+            return output.ToArray();
         }
 
         void SendPacket(HidStream stream, uint id, byte[] data)
@@ -133,20 +316,7 @@ namespace KeymapDownloader
             send[1] = (byte)id;
             Array.Copy(data, 0, send, 2, data.Length);
 
-            int retryCount = 5;
-
-            bool ret_code;
-            do
-            {
-                stream.Write(send);
-                var ret = stream.Read();
-                ret_code = ret[1] == 0xc1;
-            } while (!ret_code && retryCount-- > 0);
-
-            if (retryCount == 0)
-            {
-                throw new Exception("发送重试次数达到上限");
-            }
+            stream.Write(send);
         }
 
         private void Devices_SelectionChanged(object sender, SelectionChangedEventArgs e)
@@ -11,6 +11,8 @@
 #include "ble_services.h"
 #include "report.h"
 #include "keymap_storage.h"
+#include "report_queue.h"
+#include "keyboard_led.h"
 
 #define OUTPUT_REPORT_MAX_LEN 1                 /**< Maximum length of Output Report. */
 #define INPUT_REPORT_KEYS_INDEX 0               /**< Index of Input Report. */
@@ -24,7 +26,8 @@
 #define CONSUMER_INPUT_REPORT_INDEX     2
 #define INPUT_REPORT_COUNT              3
 
-#define MAX_BUFFER_ENTRIES 0x10 /**< Number of elements that can be enqueued */
+STATIC_ASSERT(INPUT_REPORT_COUNT == REPORT_QUEUE_IDS);
+STATIC_ASSERT(INPUT_REPORT_KEYS_MAX_LEN <= REPORT_SLOT_SIZE);
 
 #define BASE_USB_HID_SPEC_VERSION 0x0101 /**< Version number of base USB HID Specification implemented by this application. */
 
@@ -103,59 +106,11 @@ static bool m_in_boot_mode = false;                      /**< Current protocol m
 
 uint8_t led_val;
 
-/** Abstracts buffer element */
-typedef struct hid_key_buffer
-{
-    uint8_t data_len;       /**< Total length of data */
-    uint8_t *p_data;        /**< Scanned key pattern */
-    ble_hids_t *p_instance; /**< Identifies peer and service instance */
-} buffer_entry_t;
-
-STATIC_ASSERT(sizeof(buffer_entry_t) % 4 == 0);
-
-
-/** Circular buffer list */
-typedef struct
-{
-    buffer_entry_t buffer[MAX_BUFFER_ENTRIES]; /**< Maximum number of entries that can enqueued in the list */
-    uint8_t rp;                                /**< Index to the read location */
-    uint8_t wp;                                /**< Index to write location */
-    uint8_t count;                             /**< Number of elements in the list */
-} buffer_list_t;
-
-STATIC_ASSERT(sizeof(buffer_list_t) % 4 == 0);
-
-/** 缓存队列访问宏
- *
- * @{ */
-/** Initialization of buffer list */
-#define BUFFER_LIST_INIT()     \
-    do                         \
-    {                          \
-        buffer_list.rp = 0;    \
-        buffer_list.wp = 0;    \
-        buffer_list.count = 0; \
-    } while (0)
-
-/** Provide status of data list is full or not */
-#define BUFFER_LIST_FULL() \
-    ((MAX_BUFFER_ENTRIES == buffer_list.count - 1) ? true : false)
-
-/** Provides status of buffer list is empty or not */
-#define BUFFER_LIST_EMPTY() \
-    ((0 == buffer_list.count) ? true : false)
-
-#define BUFFER_ELEMENT_INIT(i)                 \
-    do                                         \
-    {                                          \
-        buffer_list.buffer[(i)].p_data = NULL; \
-    } while (0)
-
-/** List to enqueue not just data to be sent, but also related information like the handle, connection handle etc */
-static buffer_list_t buffer_list;
+/** 各输入报告的长度 */
+static uint8_t const report_len[INPUT_REPORT_COUNT] = { INPUT_REPORT_KEYS_MAX_LEN, 2, 2 };
 
 static void on_hids_evt(ble_hids_t *p_hids, ble_hids_evt_t *p_evt);
-void hids_buffer_init(void);
+static bool report_send(uint8_t index, uint8_t * p_data);
     
 /**@brief Function for initializing HID Service.
  */
@@ -255,7 +210,7 @@ void hids_init(void)
 
     err_code = ble_hids_init(&m_hids, &hids_init_obj);
     APP_ERROR_CHECK(err_code);
-    hids_buffer_init();
+    report_queue_init(report_send, report_len);
 }
 
 
@@ -283,6 +238,8 @@ static void on_hid_rep_char_write(ble_hids_evt_t *p_evt)
                 APP_ERROR_CHECK(err_code);
 
                 led_val = report_val;
+                // 空闲时扫描定时器已经停止，keyboard_task 不会同步状态灯，这里直接更新
+                led_change_handler(led_val, true);
                 break;
             }
         }
@@ -437,130 +394,32 @@ static uint32_t send_key_scan_press_release(ble_hids_t *p_hids,
 
     return err_code;
 }
-/**@brief   Function for initializing the buffer queue used to key events that could not be
- *          transmitted
- *
- * @warning This handler is an example only. You need to analyze how you wish to buffer or buffer at
- *          all.
- *
- * @note    In case of HID keyboard, a temporary buffering could be employed to handle scenarios
- *          where encryption is not yet enabled or there was a momentary link loss or there were no
- *          Transmit buffers.
- */
-void hids_buffer_init(void)
-{
-    uint32_t buffer_count;
-
-    BUFFER_LIST_INIT();
-
-    for (buffer_count = 0; buffer_count < MAX_BUFFER_ENTRIES; buffer_count++)
-    {
-        BUFFER_ELEMENT_INIT(buffer_count);
-    }
-}
-
-/**@brief Function for enqueuing key scan patterns that could not be transmitted either completely
- *        or partially.
+/**
+ * @brief 发送一个报告
  *
- * @warning This handler is an example only. You need to analyze how you wish to send the key
- *          release.
+ * 未连接或主机没有订阅时丢弃报告。
  *
- * @param[in]  p_hids         Identifies the service for which Key Notifications are buffered.
- * @param[in]  p_key_pattern  Pointer to key pattern.
- * @param[in]  pattern_len    Length of key pattern.
- * @param[in]  offset         Offset applied to Key Pattern when requesting a transmission on
- *                            dequeue, @ref buffer_dequeue.
- * @return     NRF_SUCCESS on success, else an error code indicating reason for failure.
+ * @param index 报告序号，报告 ID - 1
+ * @return 没有发送缓冲区时返回 false
  */
-uint32_t hids_buffer_enqueue(ble_hids_t *p_hids,
-                               uint8_t *p_key_pattern,
-                               uint16_t pattern_len)
+static bool report_send(uint8_t index, uint8_t * p_data)
 {
-    buffer_entry_t *element;
-    uint32_t err_code = NRF_SUCCESS;
+    uint32_t err_code;
 
-    if (BUFFER_LIST_FULL())
-    {
-        // Element cannot be buffered.
-        err_code = NRF_ERROR_NO_MEM;
-    }
+    if (index == KEYBOARD_INPUT_REPORT_INDEX)
+        err_code = send_key_scan_press_release(&m_hids, p_data, INPUT_REPORT_KEYS_MAX_LEN);
     else
-    {
-        // Make entry of buffer element and copy data.
-        element = &buffer_list.buffer[(buffer_list.wp)];
-        element->p_instance = p_hids;
-        element->p_data = p_key_pattern;
-        element->data_len = pattern_len;
-
-        buffer_list.count++;
-        buffer_list.wp++;
+        err_code = ble_hids_inp_rep_send(&m_hids, index, report_len[index], p_data);
 
-        if (buffer_list.wp == MAX_BUFFER_ENTRIES)
-        {
-            buffer_list.wp = 0;
-        }
-    }
-
-    return err_code;
-}
-
-/**@brief   Function to dequeue key scan patterns that could not be transmitted either completely of
- *          partially.
- *
- * @warning This handler is an example only. You need to analyze how you wish to send the key
- *          release.
- *
- * @param[in]  tx_flag   Indicative of whether the dequeue should result in transmission or not.
- * @note       A typical example when all keys are dequeued with transmission is when link is
- *             disconnected.
- *
- * @return     NRF_SUCCESS on success, else an error code indicating reason for failure.
- */
-uint32_t hids_buffer_dequeue(bool tx_flag)
-{ 
-    buffer_entry_t *p_element;
-    uint32_t err_code = NRF_SUCCESS;
-
-    if (BUFFER_LIST_EMPTY())
-    {
-        err_code = NRF_ERROR_NOT_FOUND;
-    }
-    else
+    if (err_code == BLE_ERROR_NO_TX_BUFFERS)
+        return false;
+    if ((err_code != NRF_SUCCESS) &&
+        (err_code != NRF_ERROR_INVALID_STATE) &&
+        (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
     {
-        bool remove_element = true;
-
-        p_element = &buffer_list.buffer[(buffer_list.rp)];
-
-        if (tx_flag)
-        {
-            err_code = send_key_scan_press_release(p_element->p_instance,
-                                                   p_element->p_data,
-                                                   p_element->data_len);
-            // An additional notification is needed for release of all keys, therefore check
-            // is for actual_len <= element->data_len and not actual_len < element->data_len
-            if (err_code == BLE_ERROR_NO_TX_BUFFERS)
-            {
-                // Transmission could not be completed, do not remove the entry, adjust next data to
-                // be transmitted
-                remove_element = false;
-            }
-        }
-
-        if (remove_element)
-        {
-            BUFFER_ELEMENT_INIT(buffer_list.rp);
-
-            buffer_list.rp++;
-            buffer_list.count--;
-
-            if (buffer_list.rp == MAX_BUFFER_ENTRIES)
-            {
-                buffer_list.rp = 0;
-            }
-        }
+        APP_ERROR_HANDLER(err_code);
     }
-
-    return err_code;
+    return true;
 }
 
 /**@brief Function for sending sample key presses to the peer.
@@ -570,29 +429,7 @@ uint32_t hids_buffer_dequeue(bool tx_flag)
  */
 void hids_keys_send(uint8_t key_pattern_len, uint8_t *p_key_pattern)
 {
-    uint32_t err_code;
-
-    err_code = send_key_scan_press_release(&m_hids,
-                                           p_key_pattern,
-                                           key_pattern_len);
-    // An additional notification is needed for release of all keys, therefore check
-    // is for actual_len <= key_pattern_len and not actual_len < key_pattern_len.
-    if (err_code == BLE_ERROR_NO_TX_BUFFERS)
-    {
-        // Buffer enqueue routine return value is not intentionally checked.
-        // Rationale: Its better to have a a few keys missing than have a system
-        // reset. Recommendation is to work out most optimal value for
-        // MAX_BUFFER_ENTRIES to minimize chances of buffer queue full condition
-        UNUSED_VARIABLE(hids_buffer_enqueue(&m_hids, p_key_pattern, key_pattern_len));
-    }
-
-    if ((err_code != NRF_SUCCESS) &&
-        (err_code != NRF_ERROR_INVALID_STATE) &&
-        (err_code != BLE_ERROR_NO_TX_BUFFERS) &&
-        (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
-    {
-        APP_ERROR_HANDLER(err_code);
-    }
+    report_queue_submit(KEYBOARD_INPUT_REPORT_INDEX, p_key_pattern);
 }
 /**
  * @brief 发送System Key
@@ -602,20 +439,7 @@ void hids_keys_send(uint8_t key_pattern_len, uint8_t *p_key_pattern)
  */
 void hids_system_key_send(uint8_t key_pattern_len, uint8_t *p_key_pattern)
 {
-    
-    uint32_t err_code;
-    err_code = ble_hids_inp_rep_send(&m_hids,
-                                         REPORT_ID_SYSTEM - 1,
-                                         key_pattern_len,
-                                         p_key_pattern);
-    if ((err_code != NRF_SUCCESS) &&
-        (err_code != NRF_ERROR_INVALID_STATE) &&
-        (err_code != BLE_ERROR_NO_TX_BUFFERS) &&
-        (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
-    {
-        APP_ERROR_HANDLER(err_code);
-    }
-    
+    report_queue_submit(SYSTEM_INPUT_REPORT_INDEX, p_key_pattern);
 }
 /**
  * @brief 发送Consumer Key
@@ -625,34 +449,29 @@ void hids_system_key_send(uint8_t key_pattern_len, uint8_t *p_key_pattern)
  */
 void hids_consumer_key_send(uint8_t key_pattern_len, uint8_t *p_key_pattern)
 {
-    
-    uint32_t err_code;
-    err_code = ble_hids_inp_rep_send(&m_hids,
-                                         REPORT_ID_CONSUMER - 1,
-                                         key_pattern_len,
-                                         p_key_pattern);
-    if ((err_code != NRF_SUCCESS) &&
-        (err_code != NRF_ERROR_INVALID_STATE) &&
-        (err_code != BLE_ERROR_NO_TX_BUFFERS) &&
-        (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
-    {
-        APP_ERROR_HANDLER(err_code);
-    }
-    
+    report_queue_submit(CONSUMER_INPUT_REPORT_INDEX, p_key_pattern);
 }
 
 void hids_on_ble_evt(ble_evt_t *p_ble_evt)
 {
+    uint32_t err_code;
+    uint8_t tx_buffers;
+
     ble_hids_on_ble_evt(&m_hids, p_ble_evt);
     switch (p_ble_evt->header.evt_id)
     {
+        case BLE_GAP_EVT_CONNECTED:
+        err_code = sd_ble_tx_buffer_count_get(&tx_buffers);
+        APP_ERROR_CHECK(err_code);
+        report_queue_tx_buffers(tx_buffers);
+        break;
         case BLE_EVT_TX_COMPLETE:
-        // Send next key event
-        (void)hids_buffer_dequeue(true);
+        // Send queued key events, one per freed buffer
+        report_queue_tx_complete(p_ble_evt->evt.common_evt.params.tx_complete.count);
         break;
         case BLE_GAP_EVT_DISCONNECTED:
         // Dequeue all keys without transmission.
-        (void)hids_buffer_dequeue(false);
+        report_queue_flush();
         break;
     default:
         break;
@@ -25,6 +25,7 @@
 #include "softdevice_handler_appsh.h"
 #include "device_manager.h"
 #include "pstorage.h"
+#include "storage.h"
 
 #include "bootloader_util.h"
 #include "../tmk/tmk_core/common/bootloader.h"
@@ -58,10 +59,26 @@
  * Interval Max * (Slave Latency + 1)* 3 < connSupervisionTimeout
  */
 
-#define MIN_CONN_INTERVAL MSEC_TO_UNITS(20, UNIT_1_25_MS) /**< Minimum connection interval (7.5 ms) */
-#define MAX_CONN_INTERVAL MSEC_TO_UNITS(60, UNIT_1_25_MS)   /**< Maximum connection interval (30 ms). */
+/* 
+ * 闲置时的参数。有数据要发送时从机不受从机延迟的限制，在下一个连接事件就会发出，
+ * 所以间隔取得较短以减少第一次按键的延迟，再用本地连接延迟跳过大部分连接事件。
+ * 本地连接延迟不能超过监督超时的一半，监督超时因此取得较长。
+ * 主机发来的状态灯等数据要等从机醒来才能收到，本地连接延迟限制在 LOCAL_LATENCY_MAX_MS 以内。
+ */
+#define MIN_CONN_INTERVAL MSEC_TO_UNITS(20, UNIT_1_25_MS) /**< Minimum connection interval (20 ms) */
+#define MAX_CONN_INTERVAL MSEC_TO_UNITS(40, UNIT_1_25_MS)   /**< Maximum connection interval (40 ms). */
 #define SLAVE_LATENCY 4                                     /**< Slave latency. */
-#define CONN_SUP_TIMEOUT MSEC_TO_UNITS(1000, UNIT_10_MS)     /**< Connection supervisory timeout (430 ms). */
+#define CONN_SUP_TIMEOUT MSEC_TO_UNITS(3000, UNIT_10_MS)     /**< Connection supervisory timeout (3 s). */
+#define LOCAL_LATENCY_MAX_MS 400                            /**< 使用本地连接延迟时，主机发来的数据最多晚多久收到 */
+
+/* 
+ * 打字时请求的低延迟参数。Apple 的主机可能拒绝低于上面规则的间隔，
+ * 此时保持原来的参数，拒绝的次数记录在 conn_profile_stats 中。
+ * 打字时不使用从机延迟，每个连接事件都醒来，主机发来的数据也不会推迟。
+ */
+#define TYPING_MIN_CONN_INTERVAL MSEC_TO_UNITS(7.5, UNIT_1_25_MS) /**< 打字时的最小连接间隔 (7.5 ms) */
+#define TYPING_MAX_CONN_INTERVAL MSEC_TO_UNITS(15, UNIT_1_25_MS)  /**< 打字时的最大连接间隔 (15 ms) */
+#define TYPING_SLAVE_LATENCY 0                                    /**< 打字时的从机延迟 */
 
 #define APP_ADV_FAST_INTERVAL 0x0028 /**< Fast advertising interval (in units of 0.625 ms. This value corresponds to 25 ms.). */
 #define APP_ADV_SLOW_INTERVAL 0x0C80 /**< Slow advertising interval (in units of 0.625 ms. This value corrsponds to 2 seconds). */
@@ -79,6 +96,8 @@
 #define SEC_PARAM_MIN_KEY_SIZE 7                                /**< Minimum encryption key size. */
 #define SEC_PARAM_MAX_KEY_SIZE 16                               /**< Maximum encryption key size. */
 
+STATIC_ASSERT(BLE_HOST_COUNT + 1 == DEVICE_MANAGER_MAX_BONDS);
+
 #ifdef BLE_DFU_APP_SUPPORT
     #define DFU_REV_MAJOR 0x00                                  /** DFU Major revision number to be exposed. */
     #define DFU_REV_MINOR 0x00                                  /** DFU Minor revision number to be exposed. */
@@ -94,11 +113,47 @@
 
 static dm_application_instance_t m_app_handle; /**< Application identifier allocated by device manager. */
 dm_handle_t m_bonded_peer_handle;       /**< Device reference handle to the current bonded central. */
+
+/* 
+ * 多主机：每个位置对应设备管理器中的一个绑定，对应关系保存在 eeconfig 中，没有对应位置的一个绑定留作备用。
+ * 只接受当前选择的主机重新连接：断开后先向它发出定向广播，之后的广播使用只有它的白名单。
+ * 选择的位置还没有绑定，或者再次选择当前的位置时开放广播，用于配对新的主机。
+ * 新的主机配对时设备管理器使用空闲的绑定，配对成功后才删除当前选择的位置原来的绑定，
+ * 再把新的绑定换到这个位置。配对失败或取消时原来的主机不受影响。
+ *
+ * eeconfig 中的主机字节：低 2 位为当前选择的位置，之后每个位置占 2 位，为绑定的序号与位置的异或。
+ * 全 0 时每个位置对应同一序号的绑定，与只保存选择的位置的旧格式相同。
+ */
+#define HOST_FIELD_BITS 2
+#define HOST_FIELD_MASK ((1 << HOST_FIELD_BITS) - 1)
+
+STATIC_ASSERT(HOST_FIELD_BITS * (BLE_HOST_COUNT + 1) <= 8);
+
+static uint8_t m_host_slot;                  /**< 当前选择的主机 */
+static uint8_t m_host_device[BLE_HOST_COUNT]; /**< 每个位置的绑定在设备管理器中的序号，互不相同 */
+static uint8_t m_conn_host = DM_INVALID_ID;  /**< 当前连接的已绑定主机在设备管理器中的序号 */
+static bool m_host_pairing = false;          /**< 正在与当前连接的主机配对 */
+static bool m_host_pairing_new = false;      /**< 配对的是新的主机，不是更新已有的绑定 */
+static bool m_host_open = false;             /**< 开放广播，接受新的主机配对 */
+static ble_gap_irk_t m_irk_unused;           /**< 白名单中占位用的 IRK，不对应任何主机 */
 static uint16_t passkey_conn_handle;
 bool passkey_required = false;
 
 static uint16_t m_conn_handle = BLE_CONN_HANDLE_INVALID; /**< Handle of the current connection. */
 
+/** 各连接参数方案 */
+static ble_gap_conn_params_t const m_conn_profiles[CONN_PROFILE_COUNT] =
+{
+    [CONN_PROFILE_TYPING] = {TYPING_MIN_CONN_INTERVAL, TYPING_MAX_CONN_INTERVAL, TYPING_SLAVE_LATENCY, CONN_SUP_TIMEOUT},
+    [CONN_PROFILE_IDLE]   = {MIN_CONN_INTERVAL, MAX_CONN_INTERVAL, SLAVE_LATENCY, CONN_SUP_TIMEOUT},
+};
+static conn_profile_t m_conn_profile = CONN_PROFILE_IDLE; /**< 最近一次请求的方案 */
+static bool m_conn_profile_reset = false;                 /**< 断开时恢复了闲置的方案，连接参数模块需要重新读取 PPCP */
+static bool m_conn_profile_retry = false;                 /**< 请求的方案因协议栈忙没有发出，下次调用时重试 */
+static ble_gap_conn_params_t m_conn_params;               /**< 当前连接使用的参数 */
+static uint16_t m_local_latency;                          /**< 当前的本地连接延迟 */
+conn_profile_stats_t conn_profile_stats;
+
 #ifdef BLE_DFU_APP_SUPPORT
 static ble_uuid_t m_adv_uuids[] = {{BLE_UUID_HUMAN_INTERFACE_DEVICE_SERVICE, BLE_UUID_TYPE_BLE}, {BLE_UUID_BATTERY_SERVICE, BLE_UUID_TYPE_BLE}, {BLE_UUID_DEVICE_INFORMATION_SERVICE, BLE_UUID_TYPE_BLE}};
 static ble_dfu_t m_dfus; /**< Structure used to identify the DFU service. */
@@ -127,6 +182,72 @@ static void conn_params_error_handler(uint32_t nrf_error)
     APP_ERROR_HANDLER(nrf_error);
 }
 
+/**
+ * @brief 连接参数协商的结果，记录到最近一次请求的方案上
+ *
+ * @param p_evt 
+ */
+static void on_conn_params_evt(ble_conn_params_evt_t * p_evt)
+{
+    if (p_evt->evt_type == BLE_CONN_PARAMS_EVT_SUCCEEDED)
+        conn_profile_stats.granted[m_conn_profile]++;
+    else
+        conn_profile_stats.rejected[m_conn_profile]++;
+}
+
+/**
+ * @brief 设置本地连接延迟
+ *
+ * 本地连接延迟让从机跳过比主机给出的从机延迟更多的连接事件。
+ * 协议栈会截短到从机延迟的整数倍，并且不超过监督超时的一半。
+ * 有数据要发送时从机仍然在下一个连接事件发出。
+ *
+ * @param latency 跳过的连接事件数，0 为关闭。实际使用的值保存在 m_local_latency
+ */
+static void local_latency_set(uint16_t latency)
+{
+    uint32_t err_code;
+    ble_opt_t opt;
+
+    if (m_conn_handle == BLE_CONN_HANDLE_INVALID || latency == m_local_latency)
+        return;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.gap_opt.local_conn_latency.conn_handle = m_conn_handle;
+    opt.gap_opt.local_conn_latency.requested_latency = latency;
+    opt.gap_opt.local_conn_latency.p_actual_latency = &m_local_latency;
+
+    err_code = sd_ble_opt_set(BLE_GAP_OPT_LOCAL_CONN_LATENCY, &opt);
+    if ((err_code != NRF_SUCCESS) &&
+        (err_code != BLE_ERROR_INVALID_CONN_HANDLE))
+    {
+        APP_ERROR_HANDLER(err_code);
+    }
+}
+
+/**
+ * @brief 闲置时在当前连接参数允许的范围内使用本地连接延迟
+ *
+ * 取监督超时的一半和 LOCAL_LATENCY_MAX_MS 中较小的一个。
+ * 连接建立和连接参数更新后协议栈会关闭本地连接延迟，需要重新设置。
+ */
+static void local_latency_update(void)
+{
+    uint16_t latency = 0;
+
+    if (m_conn_profile == CONN_PROFILE_IDLE && m_conn_params.slave_latency && m_conn_params.max_conn_interval)
+    {
+        // 监督超时的一半以内的连接事件数：(timeout * 10ms / 2) / (interval * 1.25ms)
+        uint16_t timeout_events = m_conn_params.conn_sup_timeout * 4 / m_conn_params.max_conn_interval;
+        // LOCAL_LATENCY_MAX_MS 以内的连接事件数：ms / (interval * 1.25ms)
+        uint16_t max_events = LOCAL_LATENCY_MAX_MS * 4 / 5 / m_conn_params.max_conn_interval;
+
+        latency = MIN(timeout_events, max_events);
+        latency = latency ? latency - 1 : 0;
+    }
+    local_latency_set(latency);
+}
+
 /**@brief Function for handling advertising errors.
  *
  * @param[in] nrf_error  Error code containing information about what went wrong.
@@ -264,7 +385,7 @@ static void conn_params_init(void)
     cp_init.max_conn_params_update_count = MAX_CONN_PARAMS_UPDATE_COUNT;
     cp_init.start_on_notify_cccd_handle = BLE_GATT_HANDLE_INVALID;
     cp_init.disconnect_on_fail = false;
-    cp_init.evt_handler = NULL;
+    cp_init.evt_handler = on_conn_params_evt;
     cp_init.error_handler = conn_params_error_handler;
 
     err_code = ble_conn_params_init(&cp_init);
@@ -279,7 +400,6 @@ static void conn_params_init(void)
 static void gap_params_init(void)
 {
     uint32_t err_code;
-    ble_gap_conn_params_t gap_conn_params;
     ble_gap_conn_sec_mode_t sec_mode;
 
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&sec_mode);
@@ -291,14 +411,7 @@ static void gap_params_init(void)
     err_code = sd_ble_gap_appearance_set(BLE_APPEARANCE_HID_KEYBOARD);
     APP_ERROR_CHECK(err_code);
 
-    memset(&gap_conn_params, 0, sizeof(gap_conn_params));
-
-    gap_conn_params.min_conn_interval = MIN_CONN_INTERVAL;
-    gap_conn_params.max_conn_interval = MAX_CONN_INTERVAL;
-    gap_conn_params.slave_latency = SLAVE_LATENCY;
-    gap_conn_params.conn_sup_timeout = CONN_SUP_TIMEOUT;
-
-    err_code = sd_ble_gap_ppcp_set(&gap_conn_params);
+    err_code = sd_ble_gap_ppcp_set(&m_conn_profiles[m_conn_profile]);
     APP_ERROR_CHECK(err_code);
 
     err_code = sd_ble_gap_tx_power_set(0);
@@ -331,6 +444,96 @@ static void dis_init(void)
 }
 
 
+/**
+ * @brief 填写广播数据
+ */
+static void advertising_data_build(ble_advdata_t * p_advdata)
+{
+    memset(p_advdata, 0, sizeof(*p_advdata));
+
+    p_advdata->name_type = BLE_ADVDATA_FULL_NAME;
+    p_advdata->include_appearance = true;
+    p_advdata->flags = BLE_GAP_ADV_FLAGS_LE_ONLY_LIMITED_DISC_MODE;
+    p_advdata->uuids_complete.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
+    p_advdata->uuids_complete.p_uuids = m_adv_uuids;
+}
+
+/**
+ * @brief 回复广播模块的白名单请求，白名单中只有当前选择的主机
+ *
+ * 设备管理器按 IRK 在白名单中的位置找到连接的主机，这个对应关系在 dm_whitelist_create 中建立，
+ * 所以先生成包含所有主机的白名单，排在选择的主机之前的 IRK 换为不对应任何主机的 IRK，保持它的位置不变。
+ * 这个位置还没有绑定或正在配对新的主机时回复空的白名单，开放广播。
+ */
+static void host_whitelist_reply(void)
+{
+    uint32_t err_code;
+    ble_gap_whitelist_t whitelist;
+    ble_gap_addr_t *p_whitelist_addr[BLE_GAP_WHITELIST_ADDR_MAX_COUNT];
+    ble_gap_irk_t *p_whitelist_irk[BLE_GAP_WHITELIST_IRK_MAX_COUNT];
+    uint8_t addr_count = 0, irk_count = 0;
+
+    whitelist.addr_count = BLE_GAP_WHITELIST_ADDR_MAX_COUNT;
+    whitelist.irk_count = BLE_GAP_WHITELIST_IRK_MAX_COUNT;
+    whitelist.pp_addrs = p_whitelist_addr;
+    whitelist.pp_irks = p_whitelist_irk;
+
+    err_code = dm_whitelist_create(&m_app_handle, &whitelist);
+    APP_ERROR_CHECK(err_code);
+
+    if (!m_host_open)
+    {
+        dm_handle_t handle;
+        dm_sec_keyset_t keys;
+
+        err_code = dm_handle_initialize(&handle);
+        APP_ERROR_CHECK(err_code);
+        handle.appl_id = m_app_handle;
+        handle.device_id = m_host_device[m_host_slot];
+
+        // 返回的是设备管理器中保存的身份信息，白名单也指向同一处
+        err_code = dm_distributed_keys_get(&handle, &keys);
+        if (err_code == NRF_SUCCESS)
+        {
+            dm_id_key_t * p_id = keys.keys_central.p_id_key;
+
+            for (uint8_t i = 0; i < whitelist.irk_count; i++)
+            {
+                if (whitelist.pp_irks[i] == &p_id->id_info)
+                {
+                    irk_count = i + 1;
+                    break;
+                }
+                p_whitelist_irk[i] = &m_irk_unused;
+            }
+            for (uint8_t i = 0; i < whitelist.addr_count; i++)
+            {
+                if (whitelist.pp_addrs[i] == &p_id->id_addr_info)
+                {
+                    p_whitelist_addr[0] = whitelist.pp_addrs[i];
+                    addr_count = 1;
+                    break;
+                }
+            }
+        }
+    }
+    whitelist.addr_count = addr_count;
+    whitelist.irk_count = irk_count;
+
+    if (irk_count == 0 && addr_count == 0)
+    {
+        // 使用白名单之后广播模块把广播数据改成了不可发现，开放广播时恢复
+        ble_advdata_t advdata;
+
+        advertising_data_build(&advdata);
+        err_code = ble_advdata_set(&advdata, NULL);
+        APP_ERROR_CHECK(err_code);
+    }
+
+    err_code = ble_advertising_whitelist_reply(&whitelist);
+    APP_ERROR_CHECK(err_code);
+}
+
 /**@brief Function for handling advertising events.
  *
  * @details This function will be called for advertising events which are passed to the application.
@@ -344,6 +547,7 @@ static void on_adv_evt(ble_adv_evt_t ble_adv_evt)
     switch (ble_adv_evt)
     {
     case BLE_ADV_EVT_IDLE:
+        m_host_open = false;
     #ifdef UART_SUPPORT
         if(uart_is_using_usb())
             ble_advertising_start(BLE_ADV_MODE_SLOW);
@@ -354,37 +558,32 @@ static void on_adv_evt(ble_adv_evt_t ble_adv_evt)
         break;
 
     case BLE_ADV_EVT_WHITELIST_REQUEST:
-    {
-        ble_gap_whitelist_t whitelist;
-        ble_gap_addr_t *p_whitelist_addr[BLE_GAP_WHITELIST_ADDR_MAX_COUNT];
-        ble_gap_irk_t *p_whitelist_irk[BLE_GAP_WHITELIST_IRK_MAX_COUNT];
-
-        whitelist.addr_count = BLE_GAP_WHITELIST_ADDR_MAX_COUNT;
-        whitelist.irk_count = BLE_GAP_WHITELIST_IRK_MAX_COUNT;
-        whitelist.pp_addrs = p_whitelist_addr;
-        whitelist.pp_irks = p_whitelist_irk;
-
-        err_code = dm_whitelist_create(&m_app_handle, &whitelist);
-        APP_ERROR_CHECK(err_code);
-
-        err_code = ble_advertising_whitelist_reply(&whitelist);
-        APP_ERROR_CHECK(err_code);
+        host_whitelist_reply();
         break;
-    }
     case BLE_ADV_EVT_PEER_ADDR_REQUEST:
     {
         ble_gap_addr_t peer_address;
+        dm_handle_t handle;
 
-        // Only Give peer address if we have a handle to the bonded peer.
-        if (m_bonded_peer_handle.appl_id != DM_INVALID_ID)
-        {
+        // 只向当前选择的主机发出定向广播。这个位置还没有绑定或正在配对新的主机时不回复，直接开始快速广播
+        if (m_host_open)
+            break;
 
-            err_code = dm_peer_addr_get(&m_bonded_peer_handle, &peer_address);
-            APP_ERROR_CHECK(err_code);
+        err_code = dm_handle_initialize(&handle);
+        APP_ERROR_CHECK(err_code);
+        handle.appl_id = m_app_handle;
+        handle.device_id = m_host_device[m_host_slot];
 
+        err_code = dm_peer_addr_get(&handle, &peer_address);
+        if (err_code == NRF_SUCCESS)
+        {
             err_code = ble_advertising_peer_addr_reply(&peer_address);
             APP_ERROR_CHECK(err_code);
         }
+        else if (err_code != (NRF_ERROR_NOT_FOUND | DEVICE_MANAGER_ERR_BASE))
+        {
+            APP_ERROR_HANDLER(err_code);
+        }
         break;
     }
     default:
@@ -404,7 +603,22 @@ static void on_ble_evt(ble_evt_t *p_ble_evt)
     switch (p_ble_evt->header.evt_id)
     {
     case BLE_GAP_EVT_CONNECTED:
+        if (m_conn_profile_reset)
+        {
+            // 连接参数模块仍保存着断开前请求的参数，在它开始协商之前重新从 PPCP 读取
+            m_conn_profile_reset = false;
+            conn_params_init();
+        }
         m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+        m_conn_params = p_ble_evt->evt.gap_evt.params.connected.conn_params;
+        m_local_latency = 0;
+        local_latency_update();
+        break;
+
+    case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+        m_conn_params = p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params;
+        m_local_latency = 0;
+        local_latency_update();
         break;
 
     case BLE_EVT_TX_COMPLETE:
@@ -413,6 +627,16 @@ static void on_ble_evt(ble_evt_t *p_ble_evt)
     case BLE_GAP_EVT_DISCONNECTED:
         m_conn_handle = BLE_CONN_HANDLE_INVALID;
 
+        // 下次连接从闲置的方案开始，打字时再请求低延迟参数
+        if (m_conn_profile != CONN_PROFILE_IDLE)
+        {
+            m_conn_profile = CONN_PROFILE_IDLE;
+            m_conn_profile_reset = true;
+            m_conn_profile_retry = false;
+            err_code = sd_ble_gap_ppcp_set(&m_conn_profiles[CONN_PROFILE_IDLE]);
+            APP_ERROR_CHECK(err_code);
+        }
+
         // Reset m_caps_on variable. Upon reconnect, the HID host will re-send the Output
         // report containing the Caps lock state.
         break;
@@ -468,22 +692,14 @@ static void on_ble_evt(ble_evt_t *p_ble_evt)
 static void advertising_init(void)
 {
     uint32_t err_code;
-    uint8_t adv_flags;
     ble_advdata_t advdata;
 
     // Build and set advertising data
-    memset(&advdata, 0, sizeof(advdata));
-
-    adv_flags = BLE_GAP_ADV_FLAGS_LE_ONLY_LIMITED_DISC_MODE;
-    advdata.name_type = BLE_ADVDATA_FULL_NAME;
-    advdata.include_appearance = true;
-    advdata.flags = adv_flags;
-    advdata.uuids_complete.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
-    advdata.uuids_complete.p_uuids = m_adv_uuids;
+    advertising_data_build(&advdata);
 
     ble_adv_modes_config_t options =
         {
-            BLE_ADV_WHITELIST_DISABLED,
+            BLE_ADV_WHITELIST_ENABLED,
             BLE_ADV_DIRECTED_ENABLED,
             BLE_ADV_DIRECTED_SLOW_DISABLED, 0, 0,
             BLE_ADV_FAST_ENABLED, APP_ADV_FAST_INTERVAL, APP_ADV_FAST_TIMEOUT,
@@ -493,6 +709,122 @@ static void advertising_init(void)
     APP_ERROR_CHECK(err_code);
 }
 
+/**
+ * @brief 修改当前选择的主机，与位置的对应关系一起保存到 eeconfig 中
+ */
+static void host_slot_set(uint8_t slot)
+{
+    uint8_t val = slot;
+
+    m_host_slot = slot;
+    for (uint8_t i = 0; i < BLE_HOST_COUNT; i++)
+        val |= (m_host_device[i] ^ i) << (HOST_FIELD_BITS * (i + 1));
+    eeconfig_write_ble_host(val);
+}
+
+/**
+ * @brief 从 eeconfig 读取选择的主机与位置的对应关系
+ *
+ * @return 读到的内容是否有效
+ */
+static bool host_slot_load(void)
+{
+    uint8_t val = eeconfig_read_ble_host();
+    uint8_t used = 0;
+
+    m_host_slot = val & HOST_FIELD_MASK;
+    for (uint8_t i = 0; i < BLE_HOST_COUNT; i++)
+    {
+        m_host_device[i] = ((val >> (HOST_FIELD_BITS * (i + 1))) & HOST_FIELD_MASK) ^ i;
+        if (m_host_device[i] >= DEVICE_MANAGER_MAX_BONDS || (used & (1 << m_host_device[i])))
+            return false;
+        used |= 1 << m_host_device[i];
+    }
+    return m_host_slot < BLE_HOST_COUNT;
+}
+
+/**
+ * @brief 把新配对的绑定换到当前选择的位置
+ *
+ * 先删除这个位置原来的绑定。原来对应新绑定的位置（还没有绑定的位置）换为当前位置原来的序号，
+ * 新绑定是备用的绑定时原来的序号成为新的备用绑定。
+ */
+static void host_device_assign(uint8_t device_id)
+{
+    uint32_t err_code;
+    dm_handle_t handle;
+    ble_gap_addr_t peer_address;
+
+    // 位置还没有绑定时设备管理器可能正好分配了这个序号
+    if (device_id == m_host_device[m_host_slot])
+    {
+        host_slot_set(m_host_slot);
+        return;
+    }
+
+    err_code = dm_handle_initialize(&handle);
+    APP_ERROR_CHECK(err_code);
+    handle.appl_id = m_app_handle;
+    handle.device_id = m_host_device[m_host_slot];
+
+    // 没有绑定的位置不用删除，避免多余的擦除
+    err_code = dm_peer_addr_get(&handle, &peer_address);
+    if (err_code == NRF_SUCCESS)
+    {
+        err_code = dm_device_delete(&handle);
+        APP_ERROR_CHECK(err_code);
+    }
+    else if (err_code != (NRF_ERROR_NOT_FOUND | DEVICE_MANAGER_ERR_BASE))
+    {
+        APP_ERROR_HANDLER(err_code);
+    }
+
+    for (uint8_t i = 0; i < BLE_HOST_COUNT; i++)
+    {
+        if (m_host_device[i] == device_id)
+        {
+            m_host_device[i] = m_host_device[m_host_slot];
+            break;
+        }
+    }
+    m_host_device[m_host_slot] = device_id;
+    host_slot_set(m_host_slot);
+}
+
+/**
+ * @brief 找到绑定所在的位置
+ *
+ * @return 位置，没有找到时返回 BLE_HOST_COUNT
+ */
+static uint8_t host_slot_find(uint8_t device_id)
+{
+    uint8_t slot;
+
+    for (slot = 0; slot < BLE_HOST_COUNT && m_host_device[slot] != device_id; slot++)
+        ;
+    return slot;
+}
+
+/**
+ * @brief 连接加密后检查主机，断开不是当前选择的已绑定主机
+ *
+ * 平时广播的白名单中只有当前选择的主机，只有开放广播时其他已绑定的主机才能连上，在这里断开。
+ * 配对过程中的加密不检查。
+ */
+static void host_link_check(void)
+{
+    uint32_t err_code;
+
+    if (m_host_pairing || m_conn_host == m_host_device[m_host_slot])
+        return;
+
+    err_code = sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+    if (err_code != NRF_ERROR_INVALID_STATE)
+    {
+        APP_ERROR_CHECK(err_code);
+    }
+}
+
 /**@brief Function for handling the Device Manager events.
  *
  * @param[in]   p_evt   Data associated to the device manager event.
@@ -501,18 +833,53 @@ static uint32_t device_manager_evt_handler(dm_handle_t const *p_handle,
                                            dm_event_t const *p_event,
                                            ret_code_t event_result)
 {
+    if (p_event->event_id == DM_EVT_SECURITY_SETUP_COMPLETE && event_result != NRF_SUCCESS)
+    {
+        // 配对失败或被取消，设备管理器已释放分配的绑定，各位置保持不变
+        m_host_pairing = false;
+        return NRF_SUCCESS;
+    }
     APP_ERROR_CHECK(event_result);
     switch (p_event->event_id)
     {
+        case DM_EVT_SECURITY_SETUP:
+        case DM_EVT_SECURITY_SETUP_REFRESH:
+            m_host_pairing = true;
+            m_host_pairing_new = p_event->event_id == DM_EVT_SECURITY_SETUP;
+            break;
         case DM_EVT_DEVICE_CONTEXT_LOADED: // Fall through.
         case DM_EVT_SECURITY_SETUP_COMPLETE:
             m_bonded_peer_handle = (*p_handle);
+            if (p_event->event_id == DM_EVT_SECURITY_SETUP_COMPLETE)
+            {
+                // 新的主机替换当前选择的位置；已绑定的主机重新配对总是被接受，并切换到它的位置
+                m_host_pairing = false;
+                m_host_open = false;
+                m_conn_host = p_handle->device_id;
+                if (m_host_pairing_new)
+                {
+                    host_device_assign(p_handle->device_id);
+                }
+                else
+                {
+                    uint8_t slot = host_slot_find(p_handle->device_id);
+                    if (slot < BLE_HOST_COUNT)
+                        host_slot_set(slot);
+                }
+            }
             break;
-#ifdef BLE_DFU_APP_SUPPORT
         case DM_EVT_LINK_SECURED:
+            m_bonded_peer_handle = (*p_handle);
+            m_conn_host = p_handle->device_id;
+            host_link_check();
+#ifdef BLE_DFU_APP_SUPPORT
             app_context_load(p_handle);
-            break;
 #endif
+            break;
+        case DM_EVT_DISCONNECTION:
+            m_conn_host = DM_INVALID_ID;
+            m_host_pairing = false;
+            break;
     }
 
     return NRF_SUCCESS;
@@ -549,6 +916,13 @@ static void device_manager_init(bool erase_bonds)
 
     err_code = dm_register(&m_app_handle, &register_param);
     APP_ERROR_CHECK(err_code);
+
+    if (erase_bonds || !host_slot_load())
+    {
+        for (uint8_t i = 0; i < BLE_HOST_COUNT; i++)
+            m_host_device[i] = i;
+        host_slot_set(0);
+    }
 }
 
 // see dfu_app_handler.c for more information.
@@ -619,3 +993,86 @@ bool auth_key_reqired()
 {
     return passkey_required;
 }
+
+/**
+ * @brief 请求切换连接参数方案
+ *
+ * 每次从闲置转为打字（或反过来）只请求一次，主机拒绝后保持原来的参数，
+ * 直到下一次切换。没有连接时忽略；断开时恢复为闲置的方案，重新连接后按闲置的参数协商。
+ * 协议栈忙时连接参数模块已经改用了新方案的参数和 PPCP，方案保持为新的，下次调用时重新发出请求。
+ *
+ * @param profile 连接参数方案
+ */
+void conn_profile_request(conn_profile_t profile)
+{
+    uint32_t err_code;
+
+    if (m_conn_handle == BLE_CONN_HANDLE_INVALID || (profile == m_conn_profile && !m_conn_profile_retry))
+        return;
+
+    if (profile == CONN_PROFILE_TYPING)
+    {
+        // 先关闭本地连接延迟，马上要发出的报告不用等待跳过的连接事件
+        local_latency_set(0);
+    }
+
+    // 参数已经满足要求时回调在这次调用中报告成功，先记下方案，结果才会记到这次请求上
+    m_conn_profile = profile;
+    err_code = ble_conn_params_change_conn_params((ble_gap_conn_params_t *)&m_conn_profiles[profile]);
+    m_conn_profile_retry = err_code == NRF_ERROR_BUSY;
+    if (m_conn_profile_retry)
+    {
+        // 上一次更新还没有完成
+        return;
+    }
+    APP_ERROR_CHECK(err_code);
+
+    conn_profile_stats.requested[profile]++;
+
+    // 参数已经满足要求时不会有更新事件
+    local_latency_update();
+}
+
+/**
+ * @brief 切换蓝牙主机
+ *
+ * 断开当前的连接或停止正在进行的广播，然后重新开始广播。选择的主机已经绑定时先发出定向广播，
+ * 主机正在扫描时几十毫秒内即可重新连接，不用等待快速广播；还没有绑定时直接开放广播以便配对。
+ * 没有连接到选择的主机时再次选择这个位置，开放广播，配对的新主机替换这个位置原来的主机。
+ * 选择保存在 eeconfig 中，重启或唤醒后继续使用。
+ *
+ * @param slot 主机的位置，0 ~ BLE_HOST_COUNT - 1
+ */
+void ble_host_switch(uint8_t slot)
+{
+    uint32_t err_code;
+
+    if (slot >= BLE_HOST_COUNT)
+        return;
+
+    if (m_conn_handle != BLE_CONN_HANDLE_INVALID && m_conn_host == m_host_device[slot])
+    {
+        host_slot_set(slot);
+        return;
+    }
+    m_host_open = slot == m_host_slot;
+    host_slot_set(slot);
+    if (m_conn_handle != BLE_CONN_HANDLE_INVALID)
+    {
+        // 断开后广播模块会从定向广播开始重新广播
+        err_code = sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+        if (err_code != NRF_ERROR_INVALID_STATE)
+        {
+            APP_ERROR_CHECK(err_code);
+        }
+        return;
+    }
+
+    err_code = sd_ble_gap_adv_stop();
+    if (err_code != NRF_ERROR_INVALID_STATE)
+    {
+        APP_ERROR_CHECK(err_code);
+    }
+    err_code = ble_advertising_start(BLE_ADV_MODE_DIRECTED);
+    APP_ERROR_CHECK(err_code);
+}
@@ -7,9 +7,31 @@
 #include "device_manager.h"
 extern dm_handle_t m_bonded_peer_handle;
 
+/**
+ * @brief 连接参数方案
+ */
+typedef enum {
+    CONN_PROFILE_TYPING, /**< 打字时的低延迟参数 */
+    CONN_PROFILE_IDLE,   /**< 闲置时的省电参数 */
+    CONN_PROFILE_COUNT
+} conn_profile_t;
+
+/**
+ * @brief 各方案被请求、接受和拒绝的次数
+ */
+typedef struct {
+    uint16_t requested[CONN_PROFILE_COUNT];
+    uint16_t granted[CONN_PROFILE_COUNT];
+    uint16_t rejected[CONN_PROFILE_COUNT];
+} conn_profile_stats_t;
+
+extern conn_profile_stats_t conn_profile_stats;
+
 void ble_services_init(bool erase_bond);
 void ble_services_evt_dispatch(ble_evt_t *p_ble_evt);
 void auth_key_reply(uint8_t * passkey);
 bool auth_key_reqired(void);
+void conn_profile_request(conn_profile_t profile);
+void ble_host_switch(uint8_t slot);
 
 #endif
@@ -41,6 +41,7 @@
 #include "keyboard.h"
 #include "keyboard_led.h"
 #include "keyboard_matrix.h"
+#include "keyboard_scan.h"
 #include "keyboard_host_driver.h"
 #include "keymap_storage.h"
 
@@ -51,8 +52,6 @@
 #include "eeconfig.h"
 #include "uart_driver.h"
 
-#define KEYBOARD_SCAN_INTERVAL APP_TIMER_TICKS(KEYBOARD_FAST_SCAN_INTERVAL, APP_TIMER_PRESCALER)                  /**< Keyboard scan interval (ticks). */
-#define KEYBOARD_SCAN_INTERVAL_SLOW APP_TIMER_TICKS(KEYBOARD_SLOW_SCAN_INTERVAL, APP_TIMER_PRESCALER)            /**< Keyboard slow scan interval (ticks). */
 #define KEYBOARD_FREE_INTERVAL APP_TIMER_TICKS(1000, APP_TIMER_PRESCALER)                /**< 键盘Tick计时器 */
 #define KEYBOARD_WDT_INTERVAL APP_TIMER_TICKS(1000, APP_TIMER_PRESCALER)
 
@@ -62,7 +61,6 @@
                                       BLE_STACK_HANDLER_SCHED_EVT_SIZE) /**< Maximum size of scheduler events. */
 #define SCHED_QUEUE_SIZE 0x10                                             /**< Maximum number of events in the scheduler queue. */
 
-APP_TIMER_DEF(m_keyboard_scan_timer_id);
 APP_TIMER_DEF(m_keyboard_sleep_timer_id);
 APP_TIMER_DEF(m_keyboard_wdt_timer_id);
 
@@ -101,7 +99,6 @@ void service_error_handler(uint32_t nrf_error)
     APP_ERROR_HANDLER(nrf_error);
 }
 
-static void keyboard_scan_timeout_handler(void *p_context);
 static void keyboard_sleep_timeout_handler(void *p_context);
 static void keyboard_wdt_timeout_handler(void *p_context);
 
@@ -116,11 +113,7 @@ static void timers_init(void)
     // Initialize timer module, making it use the scheduler.
     APP_TIMER_APPSH_INIT(APP_TIMER_PRESCALER, APP_TIMER_OP_QUEUE_SIZE, true);
 
-    err_code = app_timer_create(&m_keyboard_scan_timer_id,
-                                APP_TIMER_MODE_REPEATED,
-                                keyboard_scan_timeout_handler);
-
-    APP_ERROR_CHECK(err_code);
+    keyboard_scan_init();
 
     err_code = app_timer_create(&m_keyboard_sleep_timer_id,
                                 APP_TIMER_MODE_REPEATED,
@@ -176,23 +169,6 @@ void keyboard_conn_pass_enter_handler(uint8_t *key_packet, uint8_t key_packet_si
     }
 }
 
-/**
- * @brief 切换扫描模式
- * 
- * @param slow 切换至慢速扫描
- */
-static void keyboard_switch_scan_mode(bool slow)
-{
-    uint32_t err_code;
-    err_code = app_timer_stop(m_keyboard_scan_timer_id);
-    if (slow)
-        err_code = app_timer_start(m_keyboard_scan_timer_id, KEYBOARD_SCAN_INTERVAL_SLOW, NULL);
-    else
-        err_code = app_timer_start(m_keyboard_scan_timer_id, KEYBOARD_SCAN_INTERVAL, NULL);
-
-    APP_ERROR_CHECK(err_code);
-}
-
 /**
  * @brief 键盘睡眠定时器
  * 
@@ -201,11 +177,11 @@ static void keyboard_switch_scan_mode(bool slow)
 static void keyboard_sleep_timeout_handler(void *p_context)
 {
     sleep_timer_counter++;
-    if (sleep_timer_counter == SLEEP_SLOW_TIMEOUT)
+    if (sleep_timer_counter >= CONN_IDLE_TIMEOUT)
     {
-        keyboard_switch_scan_mode(true);
+        conn_profile_request(CONN_PROFILE_IDLE);
     }
-    else if (sleep_timer_counter == SLEEP_OFF_TIMEOUT)
+    if (sleep_timer_counter == SLEEP_OFF_TIMEOUT)
     {
         sleep_mode_enter(true);
     }
@@ -216,24 +192,9 @@ static void keyboard_sleep_timeout_handler(void *p_context)
  */
 static void keyboard_sleep_counter_reset(void)
 {
-    if (sleep_timer_counter >= SLEEP_SLOW_TIMEOUT)
-    {
-        keyboard_switch_scan_mode(false);
-    }
     sleep_timer_counter = 0;
 }
 
-/**@brief Function for handling the keyboard scan timer timeout.
- *
- * @details This function will be called each time the keyboard scan timer expires.
- *
- */
-static void keyboard_scan_timeout_handler(void *p_context)
-{
-    UNUSED_PARAMETER(p_context);
-    // well, as fast as possible, it's impossible.
-	keyboard_task();
-}
 /**
  * @brief 键盘按键按下的Hook
  * 
@@ -242,6 +203,7 @@ static void keyboard_scan_timeout_handler(void *p_context)
 void hook_matrix_change(keyevent_t event)
 {
     keyboard_sleep_counter_reset();
+    conn_profile_request(CONN_PROFILE_TYPING);
 }
 /**
  * @brief 发送按键报文的Hook
@@ -286,8 +248,7 @@ static void timers_start(void)
 {
     uint32_t err_code;
 
-    err_code = app_timer_start(m_keyboard_scan_timer_id, KEYBOARD_SCAN_INTERVAL, NULL);
-    APP_ERROR_CHECK(err_code);
+    keyboard_scan_start();
 
     err_code = app_timer_start(m_keyboard_sleep_timer_id, KEYBOARD_FREE_INTERVAL, NULL);
     APP_ERROR_CHECK(err_code);
@@ -436,7 +397,6 @@ void uart_state_change(bool state)
         err_code = app_timer_stop(m_keyboard_sleep_timer_id);
         APP_ERROR_CHECK(err_code);
         led_powersave_mode(false);
-        keyboard_switch_scan_mode(false);
     }
     else
     {
@@ -479,7 +439,8 @@ int main(void)
     // Start execution.
     timers_start();
     wdt_init();
-    err_code = ble_advertising_start(BLE_ADV_MODE_FAST);
+    // 先向当前选择的主机发出定向广播，没有绑定时从快速广播开始
+    err_code = ble_advertising_start(BLE_ADV_MODE_DIRECTED);
     APP_ERROR_CHECK(err_code);
     
     led_change_handler(0x01, true);
@@ -0,0 +1,165 @@
+/**
+ * @brief HID 报告发送队列
+ *
+ * 协议栈没有空闲的发送缓冲区时，按报告种类分别保存报告的副本，
+ * 发送完成事件到来后按释放的缓冲区数量依次发出，键盘报告优先。
+ * 同一种报告总是按顺序发出，队列满时只丢失中间状态，最终状态总是会发出。
+ *
+ * 本文件不依赖协议栈，由 ble_hid_service.c 提供发送函数，主机模拟中也使用同一份代码。
+ *
+ * @file report_queue.c
+ */
+#include <string.h>
+#include "report_queue.h"
+#include "app_util.h"
+
+#define REPORT_QUEUE_MASK (REPORT_QUEUE_SIZE - 1)
+
+STATIC_ASSERT((REPORT_QUEUE_SIZE & REPORT_QUEUE_MASK) == 0);
+
+typedef struct
+{
+    uint8_t data[REPORT_QUEUE_SIZE][REPORT_SLOT_SIZE];
+    uint8_t rp; /**< 读位置，自由增长，访问时取模 */
+    uint8_t wp; /**< 写位置 */
+} report_queue_t;
+
+report_queue_stats_t report_queue_stats;
+
+static report_queue_t report_queue[REPORT_QUEUE_IDS];
+static uint8_t const * report_len;
+static report_queue_send_t report_send;
+/** 估计的空闲发送缓冲区数量 */
+static uint8_t tx_free;
+
+/**
+ * @brief 初始化报告队列
+ *
+ * @param send 发送函数
+ * @param p_len 各种报告的长度，不能超过 REPORT_SLOT_SIZE
+ */
+void report_queue_init(report_queue_send_t send, uint8_t const * p_len)
+{
+    report_send = send;
+    report_len = p_len;
+    report_queue_flush();
+}
+
+/**
+ * @brief 将报告的副本放入队列
+ *
+ * 与队列中最后一个报告相同时合并。队列满时用新的报告覆盖最后一个。
+ */
+static void report_enqueue(uint8_t id, uint8_t * p_data)
+{
+    report_queue_t * p_queue = &report_queue[id];
+    uint8_t count = p_queue->wp - p_queue->rp;
+    uint8_t * p_last = p_queue->data[(uint8_t)(p_queue->wp - 1) & REPORT_QUEUE_MASK];
+
+    if (count && memcmp(p_last, p_data, report_len[id]) == 0)
+    {
+        report_queue_stats.coalesced++;
+    }
+    else if (count == REPORT_QUEUE_SIZE)
+    {
+        memcpy(p_last, p_data, report_len[id]);
+        report_queue_stats.dropped++;
+    }
+    else
+    {
+        memcpy(p_queue->data[p_queue->wp++ & REPORT_QUEUE_MASK], p_data, report_len[id]);
+        report_queue_stats.queued++;
+    }
+}
+
+static void report_queue_drain(void);
+
+/**
+ * @brief 发送报告
+ *
+ * 队列中还有任何报告时排在后面，由 report_queue_drain 按优先级发出，
+ * 不能越过等待中的键盘报告。只有直接发送失败时才认为缓冲区已满。
+ */
+void report_queue_submit(uint8_t id, uint8_t * p_data)
+{
+    if (report_queue_pending() == 0)
+    {
+        if (report_send(id, p_data))
+        {
+            if (tx_free)
+                tx_free--;
+            return;
+        }
+        tx_free = 0;
+    }
+    report_enqueue(id, p_data);
+    report_queue_drain();
+}
+
+/**
+ * @brief 按空闲的发送缓冲区数量发出队列中的报告，键盘报告优先
+ */
+static void report_queue_drain(void)
+{
+    uint8_t id = 0;
+
+    while (tx_free && id < REPORT_QUEUE_IDS)
+    {
+        report_queue_t * p_queue = &report_queue[id];
+
+        if (p_queue->rp == p_queue->wp)
+        {
+            id++;
+            continue;
+        }
+        if (!report_send(id, p_queue->data[p_queue->rp & REPORT_QUEUE_MASK]))
+        {
+            tx_free = 0;
+            return;
+        }
+        p_queue->rp++;
+        tx_free--;
+    }
+}
+
+/**
+ * @brief 设置空闲的发送缓冲区数量，连接建立时调用
+ *
+ * @param count sd_ble_tx_buffer_count_get() 返回的数量
+ */
+void report_queue_tx_buffers(uint8_t count)
+{
+    tx_free = count;
+    report_queue_drain();
+}
+
+/**
+ * @brief 协议栈发送完成，释放了 count 个缓冲区
+ */
+void report_queue_tx_complete(uint8_t count)
+{
+    tx_free += count;
+    report_queue_drain();
+}
+
+/**
+ * @brief 丢弃队列中所有的报告，断开连接时调用
+ */
+void report_queue_flush(void)
+{
+    for (uint8_t id = 0; id < REPORT_QUEUE_IDS; id++)
+        report_queue[id].rp = report_queue[id].wp;
+    tx_free = 0;
+}
+
+/**
+ * @brief 队列中等待发送的报告数
+ */
+uint8_t report_queue_pending(void)
+{
+    uint8_t count = 0;
+
+    for (uint8_t id = 0; id < REPORT_QUEUE_IDS; id++)
+        count += (uint8_t)(report_queue[id].wp - report_queue[id].rp);
+    return count;
+}
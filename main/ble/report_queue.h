@@ -0,0 +1,37 @@
+#ifndef __REPORT_QUEUE_H__
+#define __REPORT_QUEUE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define REPORT_QUEUE_IDS 3  /**< 报告的种类数 */
+#define REPORT_QUEUE_SIZE 8 /**< 每种报告可以排队的数量，必须是 2 的幂 */
+#define REPORT_SLOT_SIZE 8  /**< 最长的报告（键盘报告）的长度 */
+
+/**
+ * @brief 发送一个报告
+ *
+ * @return 报告已经交给协议栈或被丢弃时返回 true，没有发送缓冲区时返回 false
+ */
+typedef bool (*report_queue_send_t)(uint8_t id, uint8_t * p_data);
+
+/**
+ * @brief 报告队列统计
+ */
+typedef struct
+{
+    uint32_t queued;    /**< 放入队列的报告数 */
+    uint32_t coalesced; /**< 与队列中最后一个相同而合并的报告数 */
+    uint32_t dropped;   /**< 队列满时被覆盖的报告数 */
+} report_queue_stats_t;
+
+extern report_queue_stats_t report_queue_stats;
+
+void report_queue_init(report_queue_send_t send, uint8_t const * p_len);
+void report_queue_submit(uint8_t id, uint8_t * p_data);
+void report_queue_tx_buffers(uint8_t count);
+void report_queue_tx_complete(uint8_t count);
+void report_queue_flush(void);
+uint8_t report_queue_pending(void);
+
+#endif
@@ -64,7 +64,7 @@
  *       be stored. In such cases, application will be notified with DM_DEVICE_CONTEXT_FULL 
  *       as event result at the completion of the security procedure.
  */
-#define DEVICE_MANAGER_MAX_BONDS         7
+#define DEVICE_MANAGER_MAX_BONDS         4 /**< BLE_HOST_COUNT + 1，每个主机位置一个绑定，另有一个供配对新主机使用 */
 
 
 /**
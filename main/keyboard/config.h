@@ -41,8 +41,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
     #define MATRIX_ROWS 8
     #define MATRIX_COLS 14
 
-    /* define if matrix has ghost */
-    #define MATRIX_HAS_GHOST
+    /* define if matrix has ghost. matrix.c 按实际按键位置过滤鬼键，
+     * 不定义 TMK 的 MATRIX_HAS_GHOST，keyboard_task 中不再重复检查 */
+    #define MATRIX_GHOST_FILTER
 
 #endif
 
@@ -64,6 +65,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 /* Set 0 if debouncing isn't needed */
 #define DEBOUNCE    2
 
+/* 按下立即生效，只对释放消抖。注释掉则按下和释放都需要 DEBOUNCE 次扫描确认 */
+#define DEBOUNCE_EAGER_PRESS
+
 /* Mechanical locking support. Use KC_LCAP, KC_LNUM or KC_LSCR instead in keymap */
 #define LOCKING_SUPPORT_ENABLE
 
@@ -79,11 +83,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define BOOTMAGIC_KEY_BOOT              KC_U /* boot! */
 #define BOOTMAGIC_KEY_ERASE_BOND        KC_E /* erase bond info */
 
+// 蓝牙多主机
+#define BLE_HOST_COUNT 3                    // 可以用 Fn 键切换的主机数，比设备管理器的绑定数少一个
+
 // 键盘省电参数
-#define SLEEP_SLOW_TIMEOUT 15               // 键盘闲置多久后转入慢速扫描模式 (s)
 #define SLEEP_OFF_TIMEOUT 600               // 键盘闲置多久后转入自动关机 (s)
-#define KEYBOARD_FAST_SCAN_INTERVAL 10      // 通常模式下，多久扫描一次键盘 (ms)
-#define KEYBOARD_SLOW_SCAN_INTERVAL 100     // 慢速模式下，多久扫描一次键盘 (ms)
+#define CONN_IDLE_TIMEOUT 10                // 键盘闲置多久后请求省电的连接参数 (s)
+#define KEYBOARD_FAST_SCAN_INTERVAL 10      // 有按键按下时，多久扫描一次键盘 (ms)
+#define KEYBOARD_SCAN_IDLE_TIMEOUT 500      // 按键全部松开多久后停止扫描，转为按键中断唤醒 (ms)
 
 /*
  * Feature disable options
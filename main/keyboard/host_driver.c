@@ -12,11 +12,11 @@
 #include "custom_hook.h"
 #include "uart_driver.h"
 
-uint8_t keyboard_leds(void);
-void send_keyboard(report_keyboard_t * report);
-void send_mouse(report_mouse_t * report);
-void send_system(uint16_t data);
-void send_consumer(uint16_t data);
+static uint8_t keyboard_leds(void);
+static void send_keyboard(report_keyboard_t * report);
+static void send_mouse(report_mouse_t * report);
+static void send_system(uint16_t data);
+static void send_consumer(uint16_t data);
 
 host_driver_t driver = {
         keyboard_leds,
@@ -34,7 +34,7 @@ static void send_keyboard(report_keyboard_t * report)
 {
 #ifdef UART_SUPPORT
     if(uart_is_using_usb())
-        uart_send_packet(PACKET_KEYBOARD, report->raw, KEYBOARD_REPORT_SIZE);
+        uart_send_report(PACKET_KEYBOARD, report->raw, KEYBOARD_REPORT_SIZE);
     else
 #endif
     hids_keys_send(KEYBOARD_REPORT_SIZE, report->raw);
@@ -48,7 +48,7 @@ static void send_system(uint16_t data)
 {
 #ifdef UART_SUPPORT
     if(uart_is_using_usb())
-        uart_send_packet(PACKET_SYSTEM, (uint8_t *)&data, 2);
+        uart_send_report(PACKET_SYSTEM, (uint8_t *)&data, 2);
     else
 #endif
     hids_system_key_send(2,(uint8_t *)&data);
@@ -58,7 +58,7 @@ static void send_consumer(uint16_t data)
 
 #ifdef UART_SUPPORT
     if(uart_is_using_usb())
-        uart_send_packet(PACKET_COMSUMER, (uint8_t *)&data, 2);
+        uart_send_report(PACKET_COMSUMER, (uint8_t *)&data, 2);
     else
 #endif
     hids_consumer_key_send(2,(uint8_t *)&data);
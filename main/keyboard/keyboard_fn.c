@@ -10,6 +10,8 @@
 
 #include "main.h"
 #include "uart_driver.h"
+#include "ble_services.h"
+#include "keyboard_led.h"
 
 void action_function(keyrecord_t *record, uint8_t id, uint8_t opt)
 {
@@ -25,6 +27,10 @@ void action_function(keyrecord_t *record, uint8_t id, uint8_t opt)
                 uart_switch_mode();
                 #endif
             break;
+            case SWITCH_HOST:
+                ble_host_switch(opt);
+                led_notice(1 << opt, 0); // 用指示灯显示选择的主机
+            break;
             default:
                 break;
         }
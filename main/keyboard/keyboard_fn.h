@@ -6,6 +6,7 @@
 enum fn_functions {
     POWER_SLEEP,
     SWITCH_DEVICE,
+    SWITCH_HOST, /**< 切换蓝牙主机，opt 为主机的位置 */
 };
 
 #endif
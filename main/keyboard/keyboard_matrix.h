@@ -1,6 +1,12 @@
 #ifndef __KEYBOARD_MATRIX__
 #define __KEYBOARD_MATRIX__
 
+#include <stdbool.h>
+
 void matrix_sleep_prepare(void);
+bool matrix_is_debouncing(void);
+bool matrix_is_changed(void);
+bool matrix_wakeup_prepare(void);
+void matrix_set_wakeup_handler(void (*handler)(void));
 
 #endif
@@ -0,0 +1,117 @@
+/**
+ * @brief 键盘扫描调度
+ *
+ * 有按键按下时以 KEYBOARD_FAST_SCAN_INTERVAL 定时扫描；所有按键松开并稳定
+ * KEYBOARD_SCAN_IDLE_TIMEOUT 后停止定时器，改由 GPIO PORT 事件唤醒。
+ *
+ * @file keyboard_scan.c
+ */
+#include "main.h"
+#include "keyboard_scan.h"
+#include "keyboard_matrix.h"
+#include "nordic_common.h"
+#include "app_timer.h"
+#include "app_scheduler.h"
+#include "app_error.h"
+
+#include "keyboard.h"
+#include "matrix.h"
+
+#define KEYBOARD_SCAN_INTERVAL APP_TIMER_TICKS(KEYBOARD_FAST_SCAN_INTERVAL, APP_TIMER_PRESCALER)                  /**< Keyboard scan interval (ticks). */
+#define KEYBOARD_SCAN_IDLE_COUNT (KEYBOARD_SCAN_IDLE_TIMEOUT / KEYBOARD_FAST_SCAN_INTERVAL)                      /**< 停止扫描前需要的空闲扫描次数 */
+
+APP_TIMER_DEF(m_keyboard_scan_timer_id);
+
+static bool scanning = false;
+static bool keys_down = false;
+static uint16_t idle_scan_count = 0;
+
+/**
+ * @brief 进入空闲等待。若在准备期间按下了按键，则继续扫描
+ */
+static void keyboard_scan_idle(void)
+{
+    uint32_t err_code;
+
+    err_code = app_timer_stop(m_keyboard_scan_timer_id);
+    APP_ERROR_CHECK(err_code);
+    scanning = false;
+
+    if (!matrix_wakeup_prepare())
+        keyboard_scan_start();
+}
+
+/**@brief Function for handling the keyboard scan timer timeout.
+ *
+ * @details This function will be called each time the keyboard scan timer expires.
+ *
+ */
+static void keyboard_scan_timeout_handler(void *p_context)
+{
+    UNUSED_PARAMETER(p_context);
+    keyboard_task();
+
+    // 只在阵列发生变化时重新统计按下的按键
+    if (matrix_is_changed())
+        keys_down = matrix_key_count() != 0;
+
+    if (keys_down || matrix_is_debouncing())
+    {
+        idle_scan_count = 0;
+    }
+    else if (++idle_scan_count >= KEYBOARD_SCAN_IDLE_COUNT)
+    {
+        idle_scan_count = 0;
+        keyboard_scan_idle();
+    }
+}
+
+static void keyboard_wakeup_evt_handler(void * p_event_data, uint16_t event_size)
+{
+    UNUSED_PARAMETER(p_event_data);
+    UNUSED_PARAMETER(event_size);
+    keyboard_scan_start();
+}
+
+/**
+ * @brief 按键唤醒，在 GPIOTE 中断中调用
+ */
+static void keyboard_wakeup_handler(void)
+{
+    uint32_t err_code = app_sched_event_put(NULL, 0, keyboard_wakeup_evt_handler);
+    APP_ERROR_CHECK(err_code);
+}
+
+/**
+ * @brief 初始化扫描定时器
+ */
+void keyboard_scan_init(void)
+{
+    uint32_t err_code;
+
+    err_code = app_timer_create(&m_keyboard_scan_timer_id,
+                                APP_TIMER_MODE_REPEATED,
+                                keyboard_scan_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+
+    matrix_set_wakeup_handler(keyboard_wakeup_handler);
+}
+
+/**
+ * @brief 立即扫描一次，并开始定时扫描
+ */
+void keyboard_scan_start(void)
+{
+    uint32_t err_code;
+
+    if (scanning)
+        return;
+
+    scanning = true;
+    idle_scan_count = 0;
+    keyboard_task();
+    keys_down = matrix_key_count() != 0;
+
+    err_code = app_timer_start(m_keyboard_scan_timer_id, KEYBOARD_SCAN_INTERVAL, NULL);
+    APP_ERROR_CHECK(err_code);
+}
@@ -0,0 +1,10 @@
+#ifndef __KEYBOARD_SCAN__
+#define __KEYBOARD_SCAN__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+void keyboard_scan_init(void);
+void keyboard_scan_start(void);
+
+#endif
@@ -30,6 +30,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "action_macro.h"
 #include "keymap.h"
 
+/* 重复 KEYMAP() 参数的辅助宏 */
+#define KEYMAP_EXPAND(...) KEYMAP(__VA_ARGS__)
+#define KEYMAP_R5(K) K, K, K, K, K
+#define KEYMAP_R10(K) KEYMAP_R5(K), KEYMAP_R5(K)
+
 #ifdef KEYBOARD_4100
 
 /* 4100/4125 keymap definition macro
@@ -53,6 +58,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
     {KC_##K07, KC_##K18, KC_##K27, KC_##K37, KC_##K48, KC_##K08, KC_##K19, KC_##K28, KC_##K38, KC_##K49, KC_NO   , KC_NO   , KC_NO   , KC_NO    } \
 }
 
+/* 所有按键位置填入 KC_A，没有按键的位置保持 KC_NO。KEYMAP() 共 83 个按键 */
+#define KEYMAP_LAYOUT KEYMAP_EXPAND( \
+    KEYMAP_R10(A), KEYMAP_R10(A), KEYMAP_R10(A), KEYMAP_R10(A), \
+    KEYMAP_R10(A), KEYMAP_R10(A), KEYMAP_R10(A), KEYMAP_R10(A), \
+    A, A, A)
+
 #endif
 
 #ifdef KEYBOARD_60
@@ -74,6 +85,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
     { KC_##K40, KC_##K41, KC_##K42, KC_NO,    KC_NO,    KC_##K45, KC_NO,    KC_NO,    KC_NO,    KC_##K49, KC_##K4A, KC_##K4B, KC_##K4C, KC_##K4D }  \
 }
 
+/* 所有按键位置填入 KC_A，没有按键的位置保持 KC_NO。KEYMAP() 共 65 个按键 */
+#define KEYMAP_LAYOUT KEYMAP_EXPAND( \
+    KEYMAP_R10(A), KEYMAP_R10(A), KEYMAP_R10(A), \
+    KEYMAP_R10(A), KEYMAP_R10(A), KEYMAP_R10(A), \
+    KEYMAP_R5(A))
+
 /* ANSI variant. No extra keys for ISO */
 #define KEYMAP_ANSI( \
     K00, K01, K02, K03, K04, K05, K06, K07, K08, K09, K0A, K0B, K0C, K0D, \
@@ -22,7 +22,7 @@ const uint8_t keymaps[2][MATRIX_ROWS][MATRIX_COLS] = {
     /* 1: Fn */       
     KEYMAP( \
          TRNS, F11, F12,TRNS,TRNS,TRNS,TRNS,TRNS,TRNS,TRNS, TRNS,  TRNS, TRNS, TRNS, FN1, \
-              TRNS,TRNS,TRNS,TRNS,TRNS,TRNS,  P7,  P8,  P9, PAST,  TRNS, TRNS, TRNS, TRNS, \
+               FN3, FN4, FN5,TRNS,TRNS,TRNS,  P7,  P8,  P9, PAST,  TRNS, TRNS, TRNS, TRNS, \
          FN2,TRNS,TRNS,TRNS,TRNS,TRNS,TRNS,  P4,  P5,  P6, PMNS,  TRNS, TRNS, TRNS, TRNS, \
          TRNS,TRNS,TRNS,TRNS,TRNS,TRNS,TRNS,  P1,  P2,  P3, PPLS,  TRNS,     PENT,   TRNS, \
          TRNS,TRNS,TRNS,TRNS,TRNS,TRNS,TRNS,  P0,   TRNS, PDOT,  PSLS,  TRNS, TRNS, TRNS, \
@@ -32,7 +32,10 @@ const uint8_t keymaps[2][MATRIX_ROWS][MATRIX_COLS] = {
 const action_t PROGMEM fn_actions[] = {
     ACTION_LAYER_MOMENTARY(1), 
     ACTION_FUNCTION(POWER_SLEEP),
-    ACTION_FUNCTION(SWITCH_DEVICE)
+    ACTION_FUNCTION(SWITCH_DEVICE),
+    ACTION_FUNCTION_OPT(SWITCH_HOST, 0),
+    ACTION_FUNCTION_OPT(SWITCH_HOST, 1),
+    ACTION_FUNCTION_OPT(SWITCH_HOST, 2)
 };
 
 #endif
@@ -50,7 +53,7 @@ const uint8_t PROGMEM keymaps[][MATRIX_ROWS][MATRIX_COLS] = {
     /* 1: Poker Fn */
     KEYMAP_ANSI(
         ESC, F1,  F2,  F3,  F4,  F5,  F6,  F7,  F8,  F9,  F10, F11, F12, DEL, \
-        FN2,TRNS, UP, TRNS,TRNS,TRNS,TRNS,TRNS,TRNS,CALC,TRNS,HOME,INS, TRNS,  \
+        FN2,TRNS, UP,  FN3, FN4, FN5,TRNS,TRNS,TRNS,CALC,TRNS,HOME,INS, TRNS,  \
         FN1,LEFT,DOWN,RGHT,TRNS,TRNS,PSCR,SLCK,PAUS,TRNS,TRNS,END,      TRNS, \
         TRNS,DEL, TRNS,WHOM,MUTE,VOLU,VOLD,TRNS,PGUP,PGDN,DEL,           TRNS, \
         TRNS,TRNS,TRNS,          TRNS,                     TRNS,TRNS,TRNS,TRNS),
@@ -59,7 +62,10 @@ const action_t PROGMEM fn_actions[] = {
     /* Poker Layout */
     ACTION_LAYER_MOMENTARY(1),  // to Fn overlay
     ACTION_FUNCTION(POWER_SLEEP), // sleep
-    ACTION_FUNCTION(SWITCH_DEVICE)
+    ACTION_FUNCTION(SWITCH_DEVICE), // USB/蓝牙
+    ACTION_FUNCTION_OPT(SWITCH_HOST, 0), // 蓝牙主机 1~3
+    ACTION_FUNCTION_OPT(SWITCH_HOST, 1),
+    ACTION_FUNCTION_OPT(SWITCH_HOST, 2)
 };
 
 #endif
@@ -1,41 +1,392 @@
 #include "keymap_storage.h"
 #include "keymap.h"
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 #include "pstorage.h"
 #include "app_error.h"
 #include "keycode.h"
+#include "action_layer.h"
 
-uint8_t keymap_data[1024];
-const uint8_t layer_size = MATRIX_ROWS * MATRIX_COLS;
-const uint8_t layer_offset = 0x55;
-const uint8_t fn_offset = 0x15;
+#include "app_util.h"
+#include "nordic_common.h"
+#include "crc16.h"
+
+#define KEYMAP_LAYERS 8
+#define KEYMAP_LAYER_OFFSET 0x55
+#define KEYMAP_FN_OFFSET 0x15
+#define KEYMAP_FN_COUNT 32
+#define KEYMAP_LAYER_KEYS (MATRIX_ROWS * MATRIX_COLS)
+
+/*
+ * 压缩格式：第 0 字节为 KEYMAP_SPARSE_ENABLE，Fn 动作的位置不变，
+ * KEYMAP_LAYER_OFFSET 开始是所有层按顺序连成的一串按键，按以下记号编码：
+ *
+ *   code               (code != 0xFF) 一个按键
+ *   0xFF code count    (count != 0)   count 个相同的按键，可以跨层
+ *   0xFF 0x00 0x00                    结束
+ *
+ * 大部分按键为 KC_TRNS 或 KC_NO，压缩后同样的空间可以放下更多层。
+ * 层数由按键总数决定，最多 KEYMAP_SPARSE_LAYERS 层，不足一层的部分忽略。
+ */
+#define KEYMAP_SPARSE_ENABLE 0x5A
+#define KEYMAP_SPARSE_RUN 0xFF
+#define KEYMAP_SPARSE_LAYERS 32
+
+/*
+ * flash 中的配置镜像，两页轮流使用，按键查找时直接读取有效的一页：
+ *
+ *   | keymap_header_t | 配置 [0, KEYMAP_IMAGE_SIZE) | CRC |
+ *
+ * 配置的格式与上位机下发的一致：第 0 字节为 0x55 表示启用，KEYMAP_FN_OFFSET 处为 Fn 动作，
+ * KEYMAP_LAYER_OFFSET 处为各层按键；第 0 字节为 KEYMAP_SPARSE_ENABLE 时各层按键为压缩格式。
+ * CRC 是一个字，低 16 位为 CRC16，高 16 位为其反码，与配置匹配时镜像有效，写为 0 表示镜像已经作废。
+ *
+ * 下载先擦除没有使用的一页再写入，原来的配置一直使用到新镜像的 CRC 写入之后，再把原来那页的 CRC 写为 0。
+ * 下载中途断开或写入过程中掉电时新镜像的 CRC 不匹配，继续使用原来的配置。
+ */
+#define KEYMAP_BLOCK_SIZE 0x400
+#define KEYMAP_BLOCKS 2
+#define KEYMAP_IMAGE_MAGIC 0x4B4D
+#define KEYMAP_IMAGE_VERSION 4
+#define KEYMAP_IMAGE_SIZE (KEYMAP_BLOCK_SIZE - sizeof(keymap_header_t) - sizeof(uint32_t))
+
+typedef struct
+{
+    uint16_t magic;
+    uint8_t version;
+    uint8_t reserved;
+    uint16_t length;     /**< 镜像中配置的长度 */
+    uint16_t reserved2;
+} keymap_header_t;
+
+#define KEYMAP_DATA_OFFSET sizeof(keymap_header_t)
+#define KEYMAP_CRC_OFFSET (KEYMAP_DATA_OFFSET + KEYMAP_IMAGE_SIZE)
+#define KEYMAP_CRC_WORD(crc) ((uint32_t)(crc) | ((uint32_t)(uint16_t)~(crc) << 16))
+
+STATIC_ASSERT(sizeof(keymap_header_t) == 8);
+STATIC_ASSERT(KEYMAP_FN_OFFSET + KEYMAP_FN_COUNT * 2 <= KEYMAP_LAYER_OFFSET);
+STATIC_ASSERT(KEYMAP_IMAGE_SIZE % 4 == 0);
+STATIC_ASSERT(KEYMAP_LAYER_OFFSET + KEYMAP_LAYERS * KEYMAP_LAYER_KEYS <= KEYMAP_IMAGE_SIZE);
+
+/*
+ * 下载时每个包 KEYMAP_PACKET_SIZE 字节，收到后立即写入 flash。pstorage 异步执行写入，
+ * 排队中的包需要保留源数据，所以只用 KEYMAP_STAGING_PACKETS 个包大小的缓冲区轮流使用。
+ *
+ * 上位机一次发出多个包，包可以乱序到达，只接收 [download_next, download_next + 窗口) 内的包，
+ * 这样窗口内的包各自占用一个缓冲区，download_next 前进时还能从缓冲区按顺序计算 CRC。
+ */
+#define KEYMAP_PACKET_COUNT (1024 / KEYMAP_PACKET_SIZE)
+#define KEYMAP_STAGING_PACKETS 6
+#define KEYMAP_DOWNLOAD_WINDOW KEYMAP_STAGING_PACKETS
+
+STATIC_ASSERT(KEYMAP_PACKET_SIZE % 4 == 0);
+STATIC_ASSERT(KEYMAP_STAGING_PACKETS < PSTORAGE_CMD_QUEUE_SIZE);
+STATIC_ASSERT(KEYMAP_PACKET_COUNT <= 32);
 
-#define KEYMAP_VALID (keymap_data[0] == 0x55)
 bool storage_keymap_valid = false;
 
 /* user keymaps should be defined somewhere */
 extern const uint8_t keymaps[][MATRIX_ROWS][MATRIX_COLS];
 extern const action_t fn_actions[];
 
+/** 当前使用的按键表，行列跨度都是编译期常量 */
+static const uint8_t (*keymap_table)[MATRIX_ROWS][MATRIX_COLS] = keymaps;
+/** 下载的配置中的 Fn 动作，NULL 表示使用内置配置 */
+static uint8_t const * keymap_fn_table = NULL;
+/** 当前配置的层数 */
+static uint8_t keymap_layer_count = KEYMAP_LAYERS;
+/** 当前使用压缩格式的配置 */
+static bool keymap_sparse = false;
+
+/** 压缩格式中每层第一个按键所在的记号相对 KEYMAP_LAYER_OFFSET 的位置，以及该记号中属于上一层的按键数 */
+static uint16_t sparse_token[KEYMAP_SPARSE_LAYERS];
+static uint8_t sparse_skip[KEYMAP_SPARSE_LAYERS];
+static uint8_t sparse_layers;
+
+/** 按顺序读取一层按键，同时适用于两种格式 */
+typedef struct
+{
+    uint8_t const * p;
+    uint8_t code;
+    uint8_t run;       /**< 当前重复记号剩余的按键数 */
+} keymap_cursor_t;
+
+/** 在 cache_state 下每个按键从最高层往下找到的第一个非 KC_TRNS 键码 */
+static uint8_t keymap_cache[MATRIX_ROWS][MATRIX_COLS];
+/** 生成缓存时的层状态 */
+static uint32_t cache_state;
+/** cache_state 中的最高层，查找这一层时直接返回缓存 */
+static uint8_t cache_top;
+static bool cache_valid = false;
+
 static pstorage_handle_t       pstorage_base_block_id;
-static pstorage_handle_t       block_handle;
+static pstorage_handle_t       block_handle[KEYMAP_BLOCKS];
 
-uint8_t keymap_key_to_keycode(uint8_t layer, keypos_t key)
+/** 当前使用的镜像所在的页，没有有效的镜像时为 KEYMAP_BLOCKS */
+static uint8_t image_active = KEYMAP_BLOCKS;
+/** 镜像的头部、CRC 和作废用的 0，pstorage 异步写入时作为源数据 */
+__ALIGN(4) static keymap_header_t image_header;
+static uint32_t image_crc_word;
+static uint32_t image_invalid_word = 0;
+/** 还没有完成的 CRC 写入与作废操作，都完成后切换到新的镜像 */
+static uint8_t image_stores;
+
+static uint32_t staging[KEYMAP_STAGING_PACKETS][KEYMAP_PACKET_SIZE / 4];
+/** 正在写入 flash 的缓冲区 */
+static uint8_t staging_busy;
+/** 上位机为本次下载选择的编号，0 表示没有下载 */
+static uint16_t download_session;
+/** 下载写入的页 */
+static uint8_t download_block;
+/** 已接收的包 */
+static uint32_t download_received;
+/** 第一个没有接收的包，之前的包已计入 CRC */
+static uint8_t download_next;
+static uint16_t download_crc;
+
+static uint8_t const * keymap_block_address(uint8_t block)
 {
-    if(layer >= 8 || key.col >= MATRIX_COLS || key.row >= MATRIX_ROWS)
-        return KC_NO;
-    if(KEYMAP_VALID)
-        return keymap_data[layer_offset + layer * layer_size + key.row * MATRIX_COLS + key.col];
+    return PSTORAGE_BLOCK_ADDRESS(block_handle[block].block_id);
+}
+
+/**
+ * @brief 当前使用的配置在 flash 中的地址
+ */
+static uint8_t const * keymap_flash_data(void)
+{
+    return keymap_block_address(image_active) + KEYMAP_DATA_OFFSET;
+}
+
+/**
+ * @brief 选择按键表的来源
+ *
+ * 只在读取配置或下载状态变化时调用，查找按键时不再检查标志字节。
+ *
+ * @param downloaded 是否使用 flash 中下载的配置
+ */
+static void keymap_select(bool downloaded)
+{
+    if (downloaded)
+    {
+        uint8_t const * data = keymap_flash_data();
+
+        keymap_table = (const uint8_t (*)[MATRIX_ROWS][MATRIX_COLS])&data[KEYMAP_LAYER_OFFSET];
+        keymap_fn_table = &data[KEYMAP_FN_OFFSET];
+        keymap_sparse = data[0] == KEYMAP_SPARSE_ENABLE;
+    }
     else
-        return keymaps[layer][key.row][key.col];
+    {
+        keymap_table = keymaps;
+        keymap_fn_table = NULL;
+        keymap_sparse = false;
+    }
+    keymap_layer_count = keymap_sparse ? sparse_layers : KEYMAP_LAYERS;
+    cache_valid = false;
+}
+
+/**
+ * @brief 检查压缩格式的按键并建立每层的索引
+ *
+ * 记号不完整、超出镜像范围或没有结束标记时认为配置无效。
+ *
+ * @return 层数，0 表示无效
+ */
+static uint8_t keymap_sparse_index(uint8_t const * data)
+{
+    uint16_t pos = KEYMAP_LAYER_OFFSET;
+    uint32_t keys = 0;
+    uint8_t layers = 0;
+
+    while (pos < KEYMAP_IMAGE_SIZE)
+    {
+        uint8_t count = 1;
+
+        if (data[pos] == KEYMAP_SPARSE_RUN)
+        {
+            if (pos + 3 > KEYMAP_IMAGE_SIZE)
+                return 0;
+            count = data[pos + 2];
+            if (count == 0)
+                return MIN(keys / KEYMAP_LAYER_KEYS, KEYMAP_SPARSE_LAYERS);
+        }
+        // 记录从这个记号开始的层
+        while (layers < KEYMAP_SPARSE_LAYERS && (uint32_t)layers * KEYMAP_LAYER_KEYS < keys + count)
+        {
+            sparse_token[layers] = pos - KEYMAP_LAYER_OFFSET;
+            sparse_skip[layers] = layers * KEYMAP_LAYER_KEYS - keys;
+            layers++;
+        }
+        keys += count;
+        pos += data[pos] == KEYMAP_SPARSE_RUN ? 3 : 1;
+    }
+    return 0;
+}
+
+static void keymap_cursor_open(keymap_cursor_t * cursor, uint8_t layer)
+{
+    cursor->run = 0;
+    if (!keymap_sparse)
+    {
+        cursor->p = &keymap_table[layer][0][0];
+        return;
+    }
+
+    cursor->p = keymap_flash_data() + KEYMAP_LAYER_OFFSET + sparse_token[layer];
+    if (sparse_skip[layer])
+    {
+        // 这一层从重复记号的中间开始
+        cursor->code = cursor->p[1];
+        cursor->run = cursor->p[2] - sparse_skip[layer];
+        cursor->p += 3;
+    }
+}
+
+static uint8_t keymap_cursor_next(keymap_cursor_t * cursor)
+{
+    uint8_t code;
+
+    if (cursor->run)
+    {
+        cursor->run--;
+        return cursor->code;
+    }
+    code = *cursor->p++;
+    if (keymap_sparse && code == KEYMAP_SPARSE_RUN)
+    {
+        cursor->code = code = cursor->p[0];
+        cursor->run = cursor->p[1] - 1;
+        cursor->p += 2;
+    }
+    return code;
+}
+
+static void keymap_cursor_skip(keymap_cursor_t * cursor, uint16_t count)
+{
+    if (!keymap_sparse)
+    {
+        cursor->p += count;
+        return;
+    }
+    while (count)
+    {
+        if (cursor->run == 0 && *cursor->p != KEYMAP_SPARSE_RUN)
+        {
+            cursor->p++;
+            count--;
+            continue;
+        }
+        if (cursor->run == 0)
+        {
+            cursor->code = cursor->p[1];
+            cursor->run = cursor->p[2];
+            cursor->p += 3;
+        }
+        uint8_t n = MIN(cursor->run, count);
+        cursor->run -= n;
+        count -= n;
+    }
+}
+
+/**
+ * @brief 按层取得按键表中的原始键码
+ *
+ * 压缩格式需要从层的开头解码，只用于缓存之外的查找。
+ */
+static uint8_t keymap_layer_keycode(uint8_t layer, uint8_t row, uint8_t col)
+{
+    keymap_cursor_t cursor;
+
+    if(layer >= keymap_layer_count)
+        return KC_NO;
+    if (!keymap_sparse)
+        return keymap_table[layer][row][col];
+
+    keymap_cursor_open(&cursor, layer);
+    keymap_cursor_skip(&cursor, row * MATRIX_COLS + col);
+    return keymap_cursor_next(&cursor);
+}
+
+/**
+ * @brief 按层状态重新生成缓存
+ *
+ * 与 layer_switch_get_action() 的查找顺序相同：从最高的有效层往下，
+ * 找到第一个不是 KC_TRNS 的键码；都是 KC_TRNS 时使用第 0 层。
+ *
+ * @param state layer_state | default_layer_state
+ */
+static void keymap_cache_build(uint32_t state)
+{
+    cache_top = 0;
+    for (int8_t i = 31; i > 0; i--)
+    {
+        if (state & (1UL << i))
+        {
+            cache_top = i;
+            break;
+        }
+    }
+
+    // 逐层顺序解码，第 0 层总是参与，用于填充所有层都是 KC_TRNS 的按键
+    uint8_t * cache = &keymap_cache[0][0];
+    uint16_t pending = KEYMAP_LAYER_KEYS;
+
+    memset(cache, KC_TRNS, KEYMAP_LAYER_KEYS);
+    for (int8_t i = cache_top; i >= 0 && pending; i--)
+    {
+        keymap_cursor_t cursor;
+
+        if (!(state & (1UL << i)) && i != 0)
+            continue;
+        if (i >= keymap_layer_count)
+        {
+            // 不存在的层相当于全部为 KC_NO
+            for (uint16_t k = 0; k < KEYMAP_LAYER_KEYS; k++)
+                if (cache[k] == KC_TRNS)
+                    cache[k] = KC_NO;
+            pending = 0;
+            break;
+        }
+        keymap_cursor_open(&cursor, i);
+        for (uint16_t k = 0; k < KEYMAP_LAYER_KEYS; k++)
+        {
+            uint8_t code = keymap_cursor_next(&cursor);
+            if (cache[k] == KC_TRNS && code != KC_TRNS)
+            {
+                cache[k] = code;
+                pending--;
+            }
+        }
+    }
+    cache_state = state;
+    cache_valid = true;
+}
+
+/**
+ * @brief 取得按键的键码
+ *
+ * key 总是来自 matrix 扫描，不需要检查范围；层号可能来自下载的 Fn 配置，仍需检查。
+ *
+ * layer_switch_get_action() 从最高的有效层开始查找，这一层直接返回缓存中已经
+ * 解析好的键码，不论有多少层有效都只需一次查找。层状态变化后缓存在下一次查找时重新生成。
+ */
+uint8_t keymap_key_to_keycode(uint8_t layer, keypos_t key)
+{
+    uint32_t state = layer_state | default_layer_state;
+
+    if (!cache_valid || state != cache_state)
+        keymap_cache_build(state);
+    if (layer == cache_top)
+        return keymap_cache[key.row][key.col];
+    return keymap_layer_keycode(layer, key.row, key.col);
 }
 
 action_t keymap_fn_to_action(uint8_t keycode)
 {
-    if(KEYMAP_VALID)
+    if(keymap_fn_table != NULL)
     {
-        uint8_t index = fn_offset + FN_INDEX(keycode) * 2;
-        uint16_t action = ((uint16_t)keymap_data[index + 1] << 8) + keymap_data[index]; 
+        uint8_t index = FN_INDEX(keycode) * 2;
+        uint16_t action = ((uint16_t)keymap_fn_table[index + 1] << 8) + keymap_fn_table[index]; 
         return (action_t)action;
     }
     else
@@ -68,6 +419,18 @@ static void pstorage_callback_handler(pstorage_handle_t *p_handle, uint8_t op_co
                // Update operation failed.
            }
            break;
+        case PSTORAGE_STORE_OP_CODE:
+           if (p_data >= (uint8_t *)staging && p_data < (uint8_t *)staging + sizeof(staging))
+           {
+               staging_busy &= ~(1 << ((p_data - (uint8_t *)staging) / sizeof(staging[0])));
+           }
+           if (p_data == (uint8_t *)&image_crc_word || p_data == (uint8_t *)&image_invalid_word)
+           {
+               // 新镜像的 CRC 和原来镜像的作废都已写入 flash
+               if (image_stores && --image_stores == 0)
+                   keymap_read();
+           }
+           break;
        case PSTORAGE_CLEAR_OP_CODE:
            if (result == NRF_SUCCESS)
            {
@@ -81,6 +444,49 @@ static void pstorage_callback_handler(pstorage_handle_t *p_handle, uint8_t op_co
     }
 }
 
+static void keymap_flash_store(uint8_t block, pstorage_size_t offset, void * data, pstorage_size_t len)
+{
+    uint32_t err_code = pstorage_store(&block_handle[block], data, len, offset);
+    APP_ERROR_CHECK(err_code);
+}
+
+/**
+ * @brief 检查一页中的镜像
+ */
+static bool keymap_image_valid(uint8_t block)
+{
+    keymap_header_t const * header = (keymap_header_t const *)keymap_block_address(block);
+    uint8_t const * data = keymap_block_address(block) + KEYMAP_DATA_OFFSET;
+
+    return header->magic == KEYMAP_IMAGE_MAGIC &&
+           header->version == KEYMAP_IMAGE_VERSION &&
+           header->length == KEYMAP_IMAGE_SIZE &&
+           *(uint32_t const *)&data[KEYMAP_IMAGE_SIZE] ==
+               KEYMAP_CRC_WORD(crc16_compute(data, KEYMAP_IMAGE_SIZE, NULL));
+}
+
+/**
+ * @brief 所有包都已收到，写入头部和 CRC，再作废原来的镜像
+ */
+static void keymap_download_finish(void)
+{
+    // 回调中会重新读取并修改 image_active，先记下原来的镜像
+    uint8_t previous = image_active;
+
+    // image_header 已在开始下载时填好
+    image_crc_word = KEYMAP_CRC_WORD(download_crc);
+    // 模拟的 pstorage 同步调用回调，先设置计数
+    image_stores = previous == KEYMAP_BLOCKS ? 1 : 2;
+
+    keymap_flash_store(download_block, 0, &image_header, sizeof(image_header));
+    keymap_flash_store(download_block, KEYMAP_CRC_OFFSET, &image_crc_word, sizeof(image_crc_word));
+    if (previous != KEYMAP_BLOCKS)
+    {
+        // 新镜像的 CRC 写入之后才作废原来的镜像，两者之间掉电时两页都有效
+        keymap_flash_store(previous, KEYMAP_CRC_OFFSET, &image_invalid_word, sizeof(image_invalid_word));
+    }
+}
+
 void keymap_init(void)
 {
     //pstorage init in device manager, so do not init here 
@@ -89,53 +495,157 @@ void keymap_init(void)
     pstorage_module_param_t param;
     uint32_t                err_code;
           
-    param.block_size  = 0x400; // wow, amazing.
-    param.block_count = 1;
+    param.block_size  = KEYMAP_BLOCK_SIZE; // 每个镜像独占一页
+    param.block_count = KEYMAP_BLOCKS;
     param.cb          = pstorage_callback_handler;
         
     err_code = pstorage_register(&param, &pstorage_base_block_id);
     APP_ERROR_CHECK(err_code);
     
-    err_code = pstorage_block_identifier_get(&pstorage_base_block_id, 0, &block_handle);
-    APP_ERROR_CHECK(err_code);
+    for (uint8_t i = 0; i < KEYMAP_BLOCKS; i++)
+    {
+        err_code = pstorage_block_identifier_get(&pstorage_base_block_id, i, &block_handle[i]);
+        APP_ERROR_CHECK(err_code);
+    }
     
     keymap_read();
 }
 
-void keymap_write()
+/**
+ * @brief pstorage 队列中是否还能放入下载的写入操作
+ */
+static bool keymap_queue_ready(void)
+{
+    uint32_t count;
+
+    return pstorage_access_status_get(&count) == NRF_SUCCESS && count + 1 < KEYMAP_STAGING_PACKETS;
+}
+
+/**
+ * @brief 开始一次下载
+ *
+ * 擦除没有使用的一页用于写入，下载完成之前继续使用原来的配置。
+ * 编号与当前下载相同时是重发（应答丢失），不做处理。
+ * 上一次下载的头部和 CRC 还没有写完时 image_header 仍在使用，拒绝开始，
+ * 应答中是上一次的编号，上位机稍后重发。
+ *
+ * @param session 上位机选择的下载编号，不为 0
+ * @return 是否开始。上一次下载还在写入或写入队列已满时返回 false，上位机会重发
+ */
+bool keymap_download_begin(uint16_t session)
 {
-    uint32_t err_code;
-    if(storage_keymap_valid)
+    if (session == 0)
+        return false;
+    if (session == download_session)
+        return true;
+    if (image_stores || !keymap_queue_ready())
+        return false;
+
+    download_session = session;
+    download_received = 0;
+    download_next = 0;
+    download_crc = 0xFFFF;
+    download_block = image_active == 0 ? 1 : 0;
+
+    image_header.magic = KEYMAP_IMAGE_MAGIC;
+    image_header.version = KEYMAP_IMAGE_VERSION;
+    image_header.reserved = 0xFF;
+    image_header.length = KEYMAP_IMAGE_SIZE;
+    image_header.reserved2 = 0xFFFF;
+
+    uint32_t err_code = pstorage_clear(&block_handle[download_block], KEYMAP_BLOCK_SIZE);
+    APP_ERROR_CHECK(err_code);
+    return true;
+}
+
+/**
+ * @brief 接收一个下载的配置包
+ *
+ * 包收到后直接写入，所有包都收到后追加头部和 CRC，写入完成后切换到新的配置。
+ * 已经收到的包（应答丢失后重发）直接确认。
+ *
+ * @param id 包序号
+ * @param data KEYMAP_PACKET_SIZE 字节的数据
+ * @return 是否接收。没有开始下载、超出窗口或写入队列已满时返回 false，上位机会重发
+ */
+bool keymap_download(uint8_t id, uint8_t const * data)
+{
+    if (download_session == 0 || id >= KEYMAP_PACKET_COUNT)
+        return false;
+    if (download_received & (1UL << id))
+        return true;
+    if (id >= download_next + KEYMAP_DOWNLOAD_WINDOW)
+        return false;
+
+    uint8_t slot = id % KEYMAP_STAGING_PACKETS;
+    uint16_t offset = id * KEYMAP_PACKET_SIZE;
+    if (offset < KEYMAP_IMAGE_SIZE)
     {
-        if(KEYMAP_VALID)
-        {
-            err_code = pstorage_update(&block_handle, keymap_data, sizeof(keymap_data), 0);
-            APP_ERROR_CHECK(err_code);
-        }
-        else
-        {
-            err_code = pstorage_clear(&block_handle, sizeof(keymap_data));
-            APP_ERROR_CHECK(err_code);
-            
-            storage_keymap_valid = false;
-        }
+        uint16_t len = MIN(KEYMAP_PACKET_SIZE, KEYMAP_IMAGE_SIZE - offset);
+
+        // 缓冲区上一次的写入还没有完成
+        if ((staging_busy & (1 << slot)) || !keymap_queue_ready())
+            return false;
+        memcpy(staging[slot], data, len);
+        staging_busy |= 1 << slot;
+        keymap_flash_store(download_block, KEYMAP_DATA_OFFSET + offset, staging[slot], len);
     }
-    else
+    download_received |= 1UL << id;
+
+    // 按顺序计算 CRC，窗口内的包都还在缓冲区中
+    while (download_next < KEYMAP_PACKET_COUNT && (download_received & (1UL << download_next)))
     {
-        if(KEYMAP_VALID)
-        {
-            err_code = pstorage_update(&block_handle, keymap_data, sizeof(keymap_data), 0);
-            APP_ERROR_CHECK(err_code);
-            
-            storage_keymap_valid = true;
-        }
+        offset = download_next * KEYMAP_PACKET_SIZE;
+        if (offset < KEYMAP_IMAGE_SIZE)
+            download_crc = crc16_compute((uint8_t *)staging[download_next % KEYMAP_STAGING_PACKETS],
+                                         MIN(KEYMAP_PACKET_SIZE, KEYMAP_IMAGE_SIZE - offset), &download_crc);
+        download_next++;
+
+        if (download_next == KEYMAP_PACKET_COUNT)
+            keymap_download_finish();
     }
+    return true;
 }
 
+/**
+ * @brief 取得下载状态，用于应答上位机
+ *
+ * @param[out] session 当前下载的编号
+ * @return 已接收的包
+ */
+uint32_t keymap_download_status(uint16_t * session)
+{
+    *session = download_session;
+    return download_received;
+}
+
+/**
+ * @brief 检查 flash 中的镜像并选择按键表
+ *
+ * 新镜像的 CRC 写入之后、原来的镜像作废之前掉电时两页都有效，两者都是完整的配置，使用第一页。
+ */
 void keymap_read()
 {
-    uint32_t err_code = pstorage_load(keymap_data, &block_handle, sizeof(keymap_data), 0);
-    APP_ERROR_CHECK(err_code);
-    
-    storage_keymap_valid = KEYMAP_VALID;
+    uint8_t const * data;
+
+    for (image_active = 0; image_active < KEYMAP_BLOCKS; image_active++)
+    {
+        if (keymap_image_valid(image_active))
+            break;
+    }
+    storage_keymap_valid = image_active != KEYMAP_BLOCKS;
+    if (!storage_keymap_valid)
+    {
+        keymap_select(false);
+        return;
+    }
+
+    data = keymap_flash_data();
+    if (data[0] == KEYMAP_SPARSE_ENABLE)
+    {
+        sparse_layers = keymap_sparse_index(data);
+        storage_keymap_valid = sparse_layers > 0;
+    }
+    // 没有配置、镜像损坏或配置未启用时使用内置配置
+    keymap_select(storage_keymap_valid && (data[0] == 0x55 || data[0] == KEYMAP_SPARSE_ENABLE));
 }
@@ -2,10 +2,15 @@
 #define __KEYMAP_STORAGE__
 
 #include <stdint.h>
-extern uint8_t keymap_data[1024];
+#include <stdbool.h>
+
+/** 上位机下发配置时每个包的数据长度 */
+#define KEYMAP_PACKET_SIZE 60
 
 void keymap_init(void);
-void keymap_write(void);
 void keymap_read(void);
+bool keymap_download_begin(uint16_t session);
+bool keymap_download(uint8_t id, uint8_t const * data);
+uint32_t keymap_download_status(uint16_t * session);
 
 #endif
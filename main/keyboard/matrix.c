@@ -9,8 +9,11 @@
 #include <stdbool.h>
 
 #include "nrf.h"
+#include "nordic_common.h"
 #include "nrf_gpio.h"
 #include "nrf_delay.h"
+#include "nrf_drv_common.h"
+#include "app_util_platform.h"
 
 #include "print.h"
 #include "debug.h"
@@ -18,21 +21,58 @@
 #include "matrix.h"
 #include "keyboard_matrix.h"
 #include "keyboard_conf.h"
+#include "keymap_common.h"
 #include "wait.h"
 
 #ifndef DEBOUNCE
 #   define DEBOUNCE	1
 #endif
 
-static uint8_t debouncing = DEBOUNCE;
+/* 行选中后等待列线稳定的读取次数上限，超过时认为测量失败并使用上限值 */
+#ifndef MATRIX_SETTLE_MAX
+#   define MATRIX_SETTLE_MAX 32
+#endif
+/* 所有列都被按住而无法测量时使用的等待次数 */
+#ifndef MATRIX_SETTLE_DEFAULT
+#   define MATRIX_SETTLE_DEFAULT 2
+#endif
+/* 连续这么多次读取不变即认为列线已经稳定 */
+#define MATRIX_SETTLE_STABLE 8
 
 /* matrix state(1:on, 0:off) */
 static matrix_row_t matrix[MATRIX_ROWS];
-static matrix_row_t matrix_debouncing[MATRIX_ROWS];
+/** 消抖后的阵列状态，经过按键位置过滤和鬼键检测后写入 matrix */
+static matrix_row_t matrix_debounced[MATRIX_ROWS];
+/** 每个按键的原始状态与 matrix_debounced 不一致的连续扫描次数 */
+static uint8_t debounce_count[MATRIX_ROWS][MATRIX_COLS];
+/** 正在消抖的按键 */
+static matrix_row_t debouncing[MATRIX_ROWS];
+/** 有按键正在消抖的行 */
+static uint32_t debouncing_rows;
+/** 上一次扫描是否改变了 matrix */
+static bool matrix_changed;
+
+/** 每个位置在 KEYMAP() 中是否有按键，由 KEYMAP_LAYOUT 在编译期生成 */
+static const uint8_t matrix_layout[MATRIX_ROWS][MATRIX_COLS] = KEYMAP_LAYOUT;
+/** 每行实际存在按键的列 */
+static matrix_row_t matrix_populated[MATRIX_ROWS];
+#ifdef MATRIX_GHOST_FILTER
+/** 因存在鬼键而暂停更新的行 */
+static uint32_t ghost_rows;
+#endif
+
+/** 每行选中后等待列线稳定的读取次数，开机时由 matrix_settle_calibrate() 测得 */
+static uint8_t row_settle[MATRIX_ROWS];
+/** 所有行中最长的稳定时间 */
+static uint8_t row_settle_max;
+
+static void (*wakeup_handler)(void);
 
 static matrix_row_t read_cols(void);
 static void select_row(uint8_t row);
 static void unselect_rows(void);
+static void matrix_wakeup_disable(void);
+static void matrix_settle_calibrate(void);
 
 /**
  * @brief 初始化键盘阵列
@@ -43,7 +83,7 @@ void matrix_init(void)
     for (uint_fast8_t i = MATRIX_ROWS; i--;)
     {
         // nrf_gpio_cfg_output((uint32_t)row_pin_array[i]);
-    #ifndef MATRIX_HAS_GHOST
+    #ifndef MATRIX_GHOST_FILTER
         nrf_gpio_cfg(
             (uint32_t)row_pin_array[i],
             NRF_GPIO_PIN_DIR_OUTPUT,
@@ -66,35 +106,57 @@ void matrix_init(void)
     }
     for (uint_fast8_t i = MATRIX_COLS; i--;)
     {
-    #ifndef MATRIX_HAS_GHOST
+    #ifndef MATRIX_GHOST_FILTER
         nrf_gpio_cfg_input((uint32_t)column_pin_array[i], NRF_GPIO_PIN_PULLUP);
     #else
         nrf_gpio_cfg_input((uint32_t)column_pin_array[i], NRF_GPIO_PIN_PULLDOWN);
     #endif
     }
-}
-/** read all rows */
-static matrix_row_t read_cols(void)
-{
-    uint16_t result = 0;
 
-    for (uint_fast8_t c = 0; c < MATRIX_COLS; c++)
+    for (uint8_t r = 0; r < MATRIX_ROWS; r++)
     {
-    #ifndef MATRIX_HAS_GHOST
-        if (!nrf_gpio_pin_read((uint32_t)column_pin_array[c]))
-            result |= 1 << c;
-    #else
-        if (nrf_gpio_pin_read((uint32_t)column_pin_array[c]))
-            result |= 1 << c;
-    #endif
+        for (uint8_t c = 0; c < MATRIX_COLS; c++)
+        {
+            if (matrix_layout[r][c] != KC_NO)
+                matrix_populated[r] |= (matrix_row_t)1 << c;
+        }
     }
 
-    return result;
+    matrix_settle_calibrate();
+
+    NRF_GPIOTE->INTENCLR = GPIOTE_INTENCLR_PORT_Msk;
+    nrf_drv_common_irq_enable(GPIOTE_IRQn, APP_IRQ_PRIORITY_LOW);
+}
+/**
+ * @brief 将 IN 寄存器中第 c 列对应引脚的位移动到结果的第 c 位
+ *
+ * column_pin_array 是编译期常量，展开后每一列只剩一次移位和与运算，不再逐个读取引脚。
+ */
+#if MATRIX_COLS > 16
+#   error "COL_GATHER only supports up to 16 columns"
+#endif
+#define COL_PIN(c) column_pin_array[(c) < MATRIX_COLS ? (c) : 0]
+#define COL_BIT(in, c) ((c) < MATRIX_COLS ? (matrix_row_t)(((in) >> COL_PIN(c)) & 1) << (c) : 0)
+#define COL_GATHER(in) ( \
+    COL_BIT(in, 0)  | COL_BIT(in, 1)  | COL_BIT(in, 2)  | COL_BIT(in, 3)  | \
+    COL_BIT(in, 4)  | COL_BIT(in, 5)  | COL_BIT(in, 6)  | COL_BIT(in, 7)  | \
+    COL_BIT(in, 8)  | COL_BIT(in, 9)  | COL_BIT(in, 10) | COL_BIT(in, 11) | \
+    COL_BIT(in, 12) | COL_BIT(in, 13) | COL_BIT(in, 14) | COL_BIT(in, 15))
+
+/** read all rows */
+static matrix_row_t read_cols(void)
+{
+    // 一次读取所有引脚的状态
+    uint32_t in = NRF_GPIO->IN;
+#ifndef MATRIX_GHOST_FILTER
+    in = ~in;
+#endif
+    return COL_GATHER(in);
 }
 
 static void select_row(uint8_t row)
 {    
-#ifndef MATRIX_HAS_GHOST
+#ifndef MATRIX_GHOST_FILTER
 	nrf_gpio_pin_clear((uint32_t)row_pin_array[row]);
 #else
     nrf_gpio_pin_set((uint32_t)row_pin_array[row]);
@@ -105,7 +167,7 @@ static void unselect_rows(void)
 {
     for (uint_fast8_t i = 0; i < MATRIX_ROWS; i++)
     {
-    #ifndef MATRIX_HAS_GHOST
+    #ifndef MATRIX_GHOST_FILTER
         nrf_gpio_pin_set((uint32_t)row_pin_array[i]);
     #else
         nrf_gpio_pin_clear((uint32_t)row_pin_array[i]);
@@ -113,53 +175,261 @@ static void unselect_rows(void)
     }
 }
 
-static inline void delay_30ns(void)
+/**
+ * @brief 等待列线稳定
+ *
+ * 用读取 IN 寄存器的次数计时，与 matrix_settle_calibrate() 测量时的单位一致，
+ * 不受主频和编译器优化的影响。
+ *
+ * @param reads 读取次数
+ */
+static inline void row_settle_wait(uint8_t reads)
 {
-#ifdef __GNUC__
-#define __nop() __asm("NOP")
+    while (reads--)
+    {
+        (void)NRF_GPIO->IN;
+    }
+}
+
+/**
+ * @brief 设置列的上下拉
+ *
+ * @param idle true 为扫描时使用的上下拉，false 为相反方向，用于测量列线的翻转时间
+ */
+static void cols_pull_set(bool idle)
+{
+#ifndef MATRIX_GHOST_FILTER
+    nrf_gpio_pin_pull_t pull = idle ? NRF_GPIO_PIN_PULLUP : NRF_GPIO_PIN_PULLDOWN;
+#else
+    nrf_gpio_pin_pull_t pull = idle ? NRF_GPIO_PIN_PULLDOWN : NRF_GPIO_PIN_PULLUP;
 #endif
-    for(int i=0; i<6; i++) {
-        __nop();
-    } 
+    for (uint_fast8_t i = MATRIX_COLS; i--;)
+    {
+        nrf_gpio_cfg_input((uint32_t)column_pin_array[i], pull);
+    }
+}
+
+/**
+ * @brief 连续读取列状态直到稳定
+ *
+ * @param last 开始读取前的列状态
+ * @return 最后一次发生变化的读取序号，0 表示始终没有变化
+ */
+static uint8_t settle_measure(matrix_row_t last)
+{
+    uint8_t settled = 0;
+
+    for (uint8_t n = 1; n <= MATRIX_SETTLE_MAX && n - settled <= MATRIX_SETTLE_STABLE; n++)
+    {
+        matrix_row_t cols = read_cols();
+        if (cols != last)
+        {
+            last = cols;
+            settled = n;
+        }
+    }
+    return settled;
+}
+
+/**
+ * @brief 开机时测量每一行的稳定时间
+ *
+ * 选中一行后把列的上下拉反向再恢复，测量列线经过上下拉电阻翻转需要的读取次数。
+ * 扫描时按键释放后列线同样只靠上下拉电阻恢复，这是最慢的情况。被按住的按键会把
+ * 列线钳住，这些列不会翻转，不影响测量结果。
+ *
+ * 结果取两倍余量：走线短的板子只需等待很短时间，走线长的板子也能读到稳定的状态。
+ */
+static void matrix_settle_calibrate(void)
+{
+    row_settle_max = 0;
+    for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+    {
+        select_row(r);
+        uint8_t settle = settle_measure(read_cols());
+
+        matrix_row_t before = read_cols();
+        cols_pull_set(false);
+        uint8_t flip = settle_measure(before);
+
+        before = read_cols();
+        cols_pull_set(true);
+        uint8_t restore = settle_measure(before);
+        unselect_rows();
+
+        // 第 settle 次读取才稳定，扫描时 read_cols() 前需要等待 settle - 1 次，再留一倍余量
+        settle = MAX(settle, MAX(flip, restore));
+        settle = settle ? settle * 2 - 1 : MATRIX_SETTLE_DEFAULT;
+        row_settle[r] = MIN(settle, MATRIX_SETTLE_MAX);
+        row_settle_max = MAX(row_settle_max, row_settle[r]);
+    }
+    // 等待最后一行释放后列线恢复
+    settle_measure(read_cols());
+}
+
+/**
+ * @brief 对一行按键进行消抖
+ *
+ * 每个按键单独计数，某个按键的抖动不会推迟其他按键。
+ * 定义 DEBOUNCE_EAGER_PRESS 时，按下在第一次被扫描到时立即生效，
+ * 只有释放需要连续 DEBOUNCE 次扫描确认；否则按下和释放都需要确认。
+ *
+ * @param row 行号
+ * @param cols 本次扫描读到的列状态
+ * @return 消抖后的状态是否发生变化
+ */
+static bool debounce_row(uint8_t row, matrix_row_t cols)
+{
+    matrix_row_t diff = cols ^ matrix_debounced[row];
+    matrix_row_t active = diff | debouncing[row];
+    matrix_row_t prev = matrix_debounced[row];
+
+    if (!active)
+        return false;
+
+    for (uint_fast8_t c = 0; c < MATRIX_COLS; c++)
+    {
+        matrix_row_t mask = (matrix_row_t)1 << c;
+        if (!(active & mask))
+            continue;
+
+        if (!(diff & mask))
+        {
+            // 抖动回到了原来的状态
+            debounce_count[row][c] = 0;
+            debouncing[row] &= ~mask;
+        }
+#ifdef DEBOUNCE_EAGER_PRESS
+        else if (cols & mask)
+        {
+            matrix_debounced[row] |= mask;
+            debounce_count[row][c] = 0;
+            debouncing[row] &= ~mask;
+        }
+#endif
+        else if (++debounce_count[row][c] >= DEBOUNCE)
+        {
+            matrix_debounced[row] ^= mask;
+            debounce_count[row][c] = 0;
+            debouncing[row] &= ~mask;
+        }
+        else
+        {
+            debouncing[row] |= mask;
+        }
+    }
+
+    if (debouncing[row])
+        debouncing_rows |= 1UL << row;
+    else
+        debouncing_rows &= ~(1UL << row);
+
+    return matrix_debounced[row] != prev;
+}
+
+#ifdef MATRIX_GHOST_FILTER
+/**
+ * @brief 检查一行是否与其他行构成鬼键矩形
+ *
+ * 没有二极管时，矩形的三个角按下会让第四个角也读到按下。只有四个角都有按键时
+ * 才无法区分真实按键和鬼键；第四个角没有按键的组合可以正常上报。
+ *
+ * @param row 行号
+ * @param keys 该行已过滤掉空位置的按键
+ */
+static bool row_has_ghost(uint8_t row, matrix_row_t keys)
+{
+    if (!(keys & (keys - 1)))
+        return false;
+
+    for (uint8_t i = 0; i < MATRIX_ROWS; i++)
+    {
+        matrix_row_t common = keys & matrix_debounced[i] & matrix_populated[i];
+        if (i != row && (common & (common - 1)))
+            return true;
+    }
+    return false;
+}
+#endif
+
+/**
+ * @brief 将消抖后的状态更新到 matrix
+ *
+ * 只处理本次发生变化的行，以及之前因鬼键暂停更新的行，没有变化的扫描不产生开销。
+ *
+ * @param changed 消抖后状态发生变化的行
+ */
+static void matrix_update(uint32_t changed)
+{
+#ifdef MATRIX_GHOST_FILTER
+    if (changed)
+        changed |= ghost_rows;
+#endif
+    for (uint8_t r = 0; changed; r++, changed >>= 1)
+    {
+        if (!(changed & 1))
+            continue;
+
+        matrix_row_t keys = matrix_debounced[r] & matrix_populated[r];
+#ifdef MATRIX_GHOST_FILTER
+        if (row_has_ghost(r, keys))
+        {
+            ghost_rows |= 1UL << r;
+            continue;
+        }
+        ghost_rows &= ~(1UL << r);
+#endif
+        if (matrix[r] != keys)
+        {
+            matrix[r] = keys;
+            matrix_changed = true;
+        }
+    }
 }
 
 uint8_t matrix_scan(void)
 {
+    uint32_t changed = 0;
+
+    matrix_changed = false;
     for (uint8_t i = 0; i < MATRIX_ROWS; i++) {
         select_row(i);
 #ifdef HYBRID_MATRIX
         init_cols();
 #endif
-        delay_30ns();  // wait stable
+        row_settle_wait(row_settle[i]);  // wait stable
         matrix_row_t cols = read_cols();
-        if (matrix_debouncing[i] != cols) {
-            matrix_debouncing[i] = cols;
-            if (debouncing) {
-                debug("bounce!: "); debug_hex(debouncing); debug("\n");
-            }
-            debouncing = DEBOUNCE;
-        }
         unselect_rows();
+        if (debounce_row(i, cols))
+            changed |= 1UL << i;
     }
-
-    if (debouncing) {
-        if (--debouncing) {
-            // no need to delay here manually, because we use the clock.
-            // wait_ms(1);
-        } else {
-            for (uint8_t i = 0; i < MATRIX_ROWS; i++) {
-                matrix[i] = matrix_debouncing[i];
-            }
-        }
-    }
+    matrix_update(changed);
 
     return 1;
 }
 
+/**
+ * @brief 是否还有按键处于消抖中
+ */
+bool matrix_is_debouncing(void)
+{
+    return debouncing_rows != 0;
+}
+
+/**
+ * @brief 上一次扫描是否改变了 matrix_get_row() 的结果
+ */
+bool matrix_is_changed(void)
+{
+    return matrix_changed;
+}
+
+/**
+ * @brief 上一次扫描是否改变了阵列状态
+ */
 bool matrix_is_modified(void)
 {
-    if (debouncing) return false;
-    return true;
+    return matrix_changed;
 }
 
 
@@ -178,6 +448,75 @@ uint8_t matrix_key_count(void)
     return count;
 }
 
+/**
+ * @brief 设置空闲唤醒的回调
+ *
+ * @param handler 有按键按下时在 GPIOTE 中断中调用
+ */
+void matrix_set_wakeup_handler(void (*handler)(void))
+{
+    wakeup_handler = handler;
+}
+
+/**
+ * @brief 阵列准备进入空闲等待
+ *
+ * 同时选中所有行，并在列上开启 SENSE。任意按键按下都会产生 PORT 事件，
+ * 在 GPIOTE 中断中恢复扫描状态并调用唤醒回调。
+ *
+ * @return 是否进入了等待。若此时已有按键按下，则不会产生 PORT 事件，返回 false
+ */
+bool matrix_wakeup_prepare(void)
+{
+    for (uint8_t i = 0; i < MATRIX_ROWS; i++)
+    {
+        select_row(i);
+    }
+    for (uint8_t i = 0; i < MATRIX_COLS; i++)
+    {
+    #ifndef MATRIX_GHOST_FILTER
+        nrf_gpio_cfg_sense_input((uint32_t)column_pin_array[i], NRF_GPIO_PIN_PULLUP, NRF_GPIO_PIN_SENSE_LOW);
+    #else
+        nrf_gpio_cfg_sense_input((uint32_t)column_pin_array[i], NRF_GPIO_PIN_PULLDOWN, NRF_GPIO_PIN_SENSE_HIGH);
+    #endif
+    }
+
+    NRF_GPIOTE->EVENTS_PORT = 0;
+    NRF_GPIOTE->INTENSET = GPIOTE_INTENSET_PORT_Msk;
+
+    row_settle_wait(row_settle_max);
+    if (read_cols())
+    {
+        matrix_wakeup_disable();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief 退出空闲等待，恢复正常扫描时的引脚状态
+ */
+static void matrix_wakeup_disable(void)
+{
+    NRF_GPIOTE->INTENCLR = GPIOTE_INTENCLR_PORT_Msk;
+    for (uint8_t i = 0; i < MATRIX_COLS; i++)
+    {
+        nrf_gpio_cfg_sense_set((uint32_t)column_pin_array[i], NRF_GPIO_PIN_NOSENSE);
+    }
+    unselect_rows();
+}
+
+void GPIOTE_IRQHandler(void)
+{
+    if (NRF_GPIOTE->EVENTS_PORT && (NRF_GPIOTE->INTENSET & GPIOTE_INTENSET_PORT_Msk))
+    {
+        NRF_GPIOTE->EVENTS_PORT = 0;
+        matrix_wakeup_disable();
+        if (wakeup_handler)
+            wakeup_handler();
+    }
+}
+
 /**
  * @brief 阵列准备睡眠
  * 
@@ -185,6 +524,7 @@ uint8_t matrix_key_count(void)
 void matrix_sleep_prepare(void)
 {
     // 这里监听所有按键作为唤醒按键，所以真正的唤醒判断应该在main的初始化过程中
+    NRF_GPIOTE->INTENCLR = GPIOTE_INTENCLR_PORT_Msk;
     for (uint8_t i = 0; i < MATRIX_COLS; i++)
     {
         nrf_gpio_cfg_output((uint32_t)column_pin_array[i]);
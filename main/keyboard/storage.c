@@ -6,22 +6,52 @@
  * @date 2018-05-13
  */
 #include <stdint.h>
+#include <string.h>
 #include "eeconfig.h"
+#include "storage.h"
 #include "pstorage.h"
 #include "app_error.h"
 
 bool realIsInit = false;
 
 pstorage_handle_t       pstorage_base_block_id;
-pstorage_handle_t       block_handle;
 
-void config_pstorage_init(void);
-void config_write(void);
-void config_read(void);
-void config_update(void);
+static void config_pstorage_init(void);
+static void config_journal_load(void);
+static void config_journal_compact(void);
+static void config_set(uint8_t addr, uint8_t val);
 
 static uint8_t config_buffer[8] __attribute__ ((aligned (4))) = {EECONFIG_MAGIC_NUMBER>>8, EECONFIG_MAGIC_NUMBER % 0x100 , 0,0,0,0,0,0}; 
 
+/*
+ * 配置以日志的形式保存在 flash 中，两页轮流使用：
+ *
+ *   | JOURNAL_MAGIC | 序号 | config_buffer 快照 (8 字节) | 记录 | 记录 | ... | 0xFFFFFFFF ...
+ *
+ * 每次修改只在当前页末尾追加一条 4 字节的记录，不再擦除整页。页写满时擦除另一页，
+ * 写入当前配置的快照和加一的序号，最后写入 JOURNAL_MAGIC，原来的页保留到下一次轮换。
+ * 启动时选择有 JOURNAL_MAGIC 且序号较新的一页，读取快照并按顺序重放所有记录。
+ * 新快照写完之前掉电时原来的页仍然有效，配置不会丢失。
+ */
+#define JOURNAL_MAGIC 0x4A524E4CUL
+#define JOURNAL_SIZE PSTORAGE_FLASH_PAGE_SIZE
+#define JOURNAL_PAGES 2
+/* 记录：标记(8) | 校验(8) | 地址(8) | 值(8)，未写入的 flash 为全 1，不会被当成记录 */
+#define JOURNAL_RECORD_TAG 0x5A
+#define JOURNAL_RECORD(addr, val) \
+    (((uint32_t)JOURNAL_RECORD_TAG << 24) | ((uint32_t)(uint8_t)~((addr) ^ (val)) << 16) | ((uint32_t)(addr) << 8) | (val))
+/* pstorage 异步执行写入，排队中的记录需要各自的源数据 */
+#define JOURNAL_PENDING 8
+
+/** 快照的源数据：JOURNAL_MAGIC + 序号 + config_buffer */
+static uint32_t journal_head[2 + sizeof(config_buffer) / 4];
+static uint32_t journal_records[JOURNAL_PENDING];
+static pstorage_handle_t journal_handle[JOURNAL_PAGES];
+/** 当前写入记录的页 */
+static uint8_t journal_page;
+/** 下一条记录写入的位置 */
+static pstorage_size_t journal_offset;
+
 static void eeconfig_set_default()
 {
     config_buffer[0] = EECONFIG_MAGIC_NUMBER >> 8;
@@ -45,7 +75,7 @@ void eeconfig_init(void)
     if(realIsInit)
     {
         eeconfig_set_default();
-        config_update();
+        config_journal_compact();
     }
     else
     {
@@ -69,8 +99,7 @@ uint8_t eeconfig_read_debug(void)
 
 void eeconfig_write_debug(uint8_t val)
 {
-    config_buffer[2] = val;    
-    config_update();
+    config_set(2, val);
 }
 
 uint8_t eeconfig_read_default_layer(void)
@@ -80,8 +109,7 @@ uint8_t eeconfig_read_default_layer(void)
 
 void eeconfig_write_default_layer(uint8_t val)
 {
-    config_buffer[3] = val;    
-    config_update();
+    config_set(3, val);
 }
 
 uint8_t eeconfig_read_keymap(void)
@@ -90,8 +118,7 @@ uint8_t eeconfig_read_keymap(void)
 }
 void eeconfig_write_keymap(uint8_t val)
 {
-    config_buffer[4] = val;
-    config_update();
+    config_set(4, val);
 }
 
 #ifdef BACKLIGHT_ENABLE
@@ -101,11 +128,19 @@ uint8_t eeconfig_read_backlight(void)
 }
 void eeconfig_write_backlight(uint8_t val)
 {
-    config_buffer[6] = val;
-    config_update();
+    config_set(6, val);
 }
 #endif
 
+uint8_t eeconfig_read_ble_host(void)
+{
+    return config_buffer[7];
+}
+void eeconfig_write_ble_host(uint8_t val)
+{
+    config_set(7, val);
+}
+
 
 static void config_pstorage_callback_handler(pstorage_handle_t *p_handle, uint8_t op_code, uint32_t result, uint8_t *p_data, uint32_t data_len)
 {
@@ -153,51 +188,134 @@ static void config_pstorage_init(void)
     pstorage_module_param_t param;
     uint32_t                err_code;
           
-    param.block_size  = 0x10; // 4 byte is enough, but pstorage minimum block size is 0x10
-    param.block_count = 1;
+    param.block_size  = JOURNAL_SIZE; // 每页一个日志
+    param.block_count = JOURNAL_PAGES;
     param.cb          = config_pstorage_callback_handler;
         
     err_code = pstorage_register(&param, &pstorage_base_block_id);
     APP_ERROR_CHECK(err_code);
     
-    err_code = pstorage_block_identifier_get(&pstorage_base_block_id, 0, &block_handle);
-    APP_ERROR_CHECK(err_code);
-    
-    config_read();
-    if(config_buffer[0] != EECONFIG_MAGIC_NUMBER>>8 || config_buffer[1] != EECONFIG_MAGIC_NUMBER % 0x100)
+    for (uint8_t i = 0; i < JOURNAL_PAGES; i++)
     {
-        eeconfig_set_default();
-        config_write();
+        err_code = pstorage_block_identifier_get(&pstorage_base_block_id, i, &journal_handle[i]);
+        APP_ERROR_CHECK(err_code);
     }
+    
+    config_journal_load();
 }
 
-static void config_pstorage_write(uint8_t addr, uint8_t* data, uint8_t len)
+static void config_pstorage_write(uint8_t page, pstorage_size_t addr, uint8_t* data, pstorage_size_t len)
 {
-    uint32_t err_code = pstorage_store(&block_handle, data, len, addr);
+    uint32_t err_code = pstorage_store(&journal_handle[page], data, len, addr);
     APP_ERROR_CHECK(err_code);
 }
 
-static void config_pstorage_read(uint8_t addr, uint8_t* data, uint8_t len)
+static void config_pstorage_read(uint8_t page, pstorage_size_t addr, uint8_t* data, pstorage_size_t len)
 {
-    uint32_t err_code = pstorage_load(data, &block_handle, len, addr);
+    uint32_t err_code = pstorage_load(data, &journal_handle[page], len, addr);
     APP_ERROR_CHECK(err_code);
 }
 
-static void config_pstorage_update(uint8_t addr, uint8_t* data, uint8_t len)
+static bool config_magic_valid(uint8_t * data)
 {
-    uint32_t err_code = pstorage_update(&block_handle, data, len, addr);
-    APP_ERROR_CHECK(err_code);
+    return data[0] == EECONFIG_MAGIC_NUMBER >> 8 && data[1] == EECONFIG_MAGIC_NUMBER % 0x100;
 }
 
-static void config_update()
+/**
+ * @brief 擦除另一页，写入当前配置的快照，之后的记录追加到这一页
+ *
+ * pstorage 按顺序执行，JOURNAL_MAGIC 在快照之后写入，写入之前掉电时启动仍使用原来的页。
+ */
+static void config_journal_compact(void)
 {
-    config_pstorage_update(0,config_buffer,sizeof(config_buffer));
+    uint8_t page = journal_page ^ 1;
+    uint32_t err_code = pstorage_clear(&journal_handle[page], JOURNAL_SIZE);
+    APP_ERROR_CHECK(err_code);
+
+    journal_head[0] = JOURNAL_MAGIC;
+    journal_head[1]++;
+    memcpy(&journal_head[2], config_buffer, sizeof(config_buffer));
+    config_pstorage_write(page, 4, (uint8_t *)&journal_head[1], sizeof(journal_head) - 4);
+    config_pstorage_write(page, 0, (uint8_t *)&journal_head[0], 4);
+    journal_page = page;
+    journal_offset = sizeof(journal_head);
 }
-static void config_read()
+
+/**
+ * @brief 读取快照并重放日志
+ *
+ * 两页都有效时（轮换之后原来的页还没有擦除）使用序号较新的一页。
+ * 校验失败的记录（例如写入时掉电）被跳过，遇到未写入的位置结束。
+ * 旧版本直接保存在第一页页首的配置会被读出并转换为日志格式。
+ */
+static void config_journal_load(void)
 {
-    config_pstorage_read(0,config_buffer,sizeof(config_buffer));
+    uint32_t head[JOURNAL_PAGES][sizeof(journal_head) / 4];
+    bool found = false;
+
+    for (uint8_t i = 0; i < JOURNAL_PAGES; i++)
+    {
+        config_pstorage_read(i, 0, (uint8_t *)head[i], sizeof(head[i]));
+        if (head[i][0] != JOURNAL_MAGIC)
+            continue;
+        if (!found || (int32_t)(head[i][1] - head[journal_page][1]) > 0)
+            journal_page = i;
+        found = true;
+    }
+    if (!found)
+    {
+        journal_page = 0;
+        journal_head[1] = 0;
+        if (config_magic_valid((uint8_t *)head[0]))
+            memcpy(config_buffer, head[0], sizeof(config_buffer));
+        else
+            eeconfig_set_default();
+        config_journal_compact();
+        return;
+    }
+
+    memcpy(journal_head, head[journal_page], sizeof(journal_head));
+    memcpy(config_buffer, &journal_head[2], sizeof(config_buffer));
+    for (journal_offset = sizeof(journal_head); journal_offset < JOURNAL_SIZE; journal_offset += 4)
+    {
+        uint32_t record;
+        config_pstorage_read(journal_page, journal_offset, (uint8_t *)&record, sizeof(record));
+        if (record == PSTORAGE_FLASH_EMPTY_MASK)
+            break;
+
+        uint8_t addr = record >> 8, val = record;
+        if (record == JOURNAL_RECORD(addr, val) && addr < sizeof(config_buffer))
+            config_buffer[addr] = val;
+    }
+
+    if (!config_magic_valid(config_buffer))
+    {
+        eeconfig_set_default();
+        config_journal_compact();
+    }
 }
-static void config_write()
+
+/**
+ * @brief 修改一项配置，并在日志末尾追加一条记录
+ *
+ * @param addr 在 config_buffer 中的位置
+ * @param val 新的值
+ */
+static void config_set(uint8_t addr, uint8_t val)
 {
-    config_pstorage_write(0,config_buffer,sizeof(config_buffer));
+    if (config_buffer[addr] == val)
+        return;
+    config_buffer[addr] = val;
+
+    if (journal_offset + sizeof(uint32_t) > JOURNAL_SIZE)
+    {
+        // 日志已满，新的快照中已经包含这次修改
+        config_journal_compact();
+        return;
+    }
+
+    uint32_t * record = &journal_records[(journal_offset / 4) % JOURNAL_PENDING];
+    *record = JOURNAL_RECORD(addr, val);
+    config_pstorage_write(journal_page, journal_offset, (uint8_t *)record, sizeof(*record));
+    journal_offset += sizeof(*record);
 }
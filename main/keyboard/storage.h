@@ -0,0 +1,11 @@
+#ifndef __STORAGE_H__
+#define __STORAGE_H__
+
+#include <stdint.h>
+#include "eeconfig.h"
+
+/** 当前选择的蓝牙主机，保存在 eeconfig 之后的空闲位置 */
+uint8_t eeconfig_read_ble_host(void);
+void eeconfig_write_ble_host(uint8_t val);
+
+#endif
@@ -13,6 +13,7 @@
 #include "app_error.h"
 #include "app_uart.h"
 #include "app_util_platform.h"
+#include "app_util.h"
 #include "nrf_drv_uart.h"
 #include "nrf_gpio.h"
 #include "main.h"
@@ -23,14 +24,103 @@
 #include "keyboard_conf.h"
 #include "keyboard_led.h"
 #include "keymap_storage.h"
+#include "report.h"
+#include "crc16.h"
 
 #define UART_CHECK_INTERVAL APP_TIMER_TICKS(1500, APP_TIMER_PRESCALER)
 APP_TIMER_DEF(uart_check_timer);
+/** 确认停滞时重发报告的等待时间，远短于检查周期 */
+#define UART_RESEND_TIMEOUT APP_TIMER_TICKS(30, APP_TIMER_PRESCALER)
+/** 每次确认前进之后最多按 UART_RESEND_TIMEOUT 重发的次数，之后只在检查周期中重发 */
+#define UART_RESEND_RETRIES 3
+APP_TIMER_DEF(uart_resend_timer);
 
 uint8_t rx_buf[64];
-uint8_t tx_buf[128];
+// 发送不经过 app_uart 的 FIFO，只是 app_uart_init 要求提供
+uint8_t tx_buf[4];
+
+/** 报告以外的包最长为 PACKET_KEYMAP_ACK：Len TYPE SESSION[2] RECEIVED[4] CRC[2] */
+#define UART_FRAME_SMALL 10
+/** 报告包：Len TYPE SEQ REPORT[] CRC[2] */
+#define UART_FRAME_REPORT (5 + KEYBOARD_REPORT_SIZE)
+#define UART_TX_QUEUE_SIZE 16
+#define UART_TX_QUEUE_MASK (UART_TX_QUEUE_SIZE - 1)
+STATIC_ASSERT((UART_TX_QUEUE_SIZE & UART_TX_QUEUE_MASK) == 0);
+STATIC_ASSERT(UART_FRAME_SMALL <= UART_FRAME_REPORT);
 
-uint8_t tx_resend_buf[64];
+/**
+ * @brief 发送队列
+ *
+ * 每一项是一个组好的包，整包交给 nrf_drv_uart 发送，发送完毕（APP_UART_TX_EMPTY）后发送下一项。
+ * 报告从重发窗口复制到队列项中：报告确认之后窗口的位置会被新的报告覆盖，而它的重发可能还在队列中。
+ */
+static uint8_t tx_queue[UART_TX_QUEUE_SIZE][UART_FRAME_REPORT];
+
+static volatile uint8_t tx_head, tx_tail;
+static volatile bool tx_busy;
+
+/**
+ * @brief 发送队列满时丢弃的包数
+ */
+uint16_t uart_tx_dropped;
+
+/**
+ * @brief 可用的波特率，序号与 CH554 一侧的 baud_table 对应
+ */
+static const nrf_uart_baudrate_t uart_baud_rates[] = { UART_BAUDRATE, UART_BAUDRATE_FAST };
+#define UART_BAUD_COUNT (sizeof(uart_baud_rates) / sizeof(uart_baud_rates[0]))
+/** 一个检查周期内出现这么多错误时回落到默认波特率 */
+#define UART_BAUD_ERROR_LIMIT 4
+/** 回落后 CH554 最长需要两个检查周期才会回到默认波特率，期间不判断 ping 包 */
+#define UART_BAUD_GRACE 2
+
+typedef enum
+{
+    BAUD_IDLE,    // 没有进行中的协商
+    BAUD_REQUEST, // 已请求 CH554 切换，等待应答
+    BAUD_CONFIRM, // 已切换，等待 CH554 在新的波特率下应答
+} baud_state;
+
+static baud_state baud_current;
+static uint8_t baud_index;
+static uint8_t baud_target;
+static uint8_t baud_limit = UART_BAUD_COUNT - 1;
+static uint8_t baud_errors;
+static uint8_t baud_grace;
+
+#define UART_REPORT_MASK (UART_REPORT_WINDOW - 1)
+STATIC_ASSERT((UART_REPORT_WINDOW & UART_REPORT_MASK) == 0);
+
+/**
+ * @brief 已发送但尚未确认的按键报告，按序号存放组好的包
+ */
+static uint8_t report_window[UART_REPORT_WINDOW][UART_FRAME_REPORT];
+
+static uint8_t report_seq;     // 下一个报告的序号
+static uint8_t report_acked;   // 最早的未确认报告的序号
+static uint8_t report_checked; // 上一个检查周期时的 report_acked
+static bool report_synced;     // CH554 期待的序号已与 report_acked 同步
+static bool report_resent;     // 上次确认之后已经重发过
+static bool report_force;      // 同步时要求 CH554 无条件接受
+static uint8_t report_timer_acked; // 启动重发定时器时的 report_acked
+static uint8_t report_retries;     // 上次确认前进之后定时重发的次数
+static volatile bool report_timer_running;
+
+#define UART_REPORT_TYPES 3 // PACKET_KEYBOARD, PACKET_SYSTEM, PACKET_COMSUMER
+
+/**
+ * @brief 窗口满时每种报告最后的状态，确认之后放入窗口
+ *
+ * 窗口中未确认的包还要用于重发，不能覆盖，所以另外保存。同一种报告只保留最新的一个。
+ */
+static uint8_t report_held[UART_REPORT_TYPES][KEYBOARD_REPORT_SIZE];
+static uint8_t report_held_len[UART_REPORT_TYPES];
+static uint8_t report_held_mask;
+
+/**
+ * @brief 窗口满时被新的报告覆盖的报告数
+ */
+uint16_t uart_report_overflow;
 
 /**
  * @brief UART当前状态。
@@ -88,38 +178,351 @@ void uart_ack(bool success)
     uart_send_packet(success ? PACKET_ACK : PACKET_FAIL, NULL, 0);
 }
 
-uint8_t checksum(uint8_t * data, uint8_t len)
+void uart_init_hardware(void);
+static void uart_send_frame(uint8_t const * frame);
+static void uart_report_put(packet_type type, uint8_t const * data, uint8_t len);
+
+/**
+ * @brief 完成组包：填写长度，有数据时附加 CRC
+ *
+ * @param frame 包，TYPE 和 DATA 已经放在 frame[1] 开始的位置
+ * @param len 数据长度
+ */
+static void uart_frame_seal(uint8_t * frame, uint8_t len)
 {
-    uint8_t checksum = 0x00;
-    for (int i = 0; i < len; i++)
+    if (len == 0)
     {
-        checksum += data[i];
+        frame[0] = 1;
+        return;
     }
-    return checksum;
+
+    uint16_t crc = crc16_compute(&frame[1], len + 1, NULL);
+    frame[len + 2] = crc >> 8;
+    frame[len + 3] = crc & 0xFF;
+    frame[0] = len + 3;
 }
 
 /**
- * @brief 处理Keymap下发信息
- * 
+ * @brief 发送队列中的下一个包，需要在临界区中调用
  */
-void uart_keymap()
+static void uart_tx_start(void)
 {
-    if (checksum(recv.data, 61) != recv.data[61])
+    if (!tx_busy && tx_head != tx_tail)
     {
-        uart_ack(false);
+        uint8_t const * frame = tx_queue[tx_head & UART_TX_QUEUE_MASK];
+
+        tx_busy = nrf_drv_uart_tx(frame, frame[0] + 1) == NRF_SUCCESS;
     }
-    else
+}
+
+/**
+ * @brief 当前的包发送完毕
+ */
+static void uart_tx_done(void)
+{
+    CRITICAL_REGION_ENTER();
+    if (tx_busy)
+    {
+        tx_busy = false;
+        tx_head++;
+    }
+    uart_tx_start();
+    CRITICAL_REGION_EXIT();
+}
+
+/**
+ * @brief 以 baud_target 重新打开串口，并在新的波特率下确认
+ *
+ * 不能在 UART 事件回调中关闭串口，由调度器执行。
+ */
+static void uart_baud_switch_evt_handler(void * p_event_data, uint16_t event_size)
+{
+    (void)p_event_data;
+    (void)event_size;
+
+    if (uart_current_mode == UART_MODE_IDLE)
+        return;
+
+    baud_index = baud_target;
+    baud_errors = 0;
+    app_uart_close();
+    uart_init_hardware();
+    current = STATE_IDLE;
+
+    // 关闭串口时正在发送的包在新的波特率下从头重发
+    CRITICAL_REGION_ENTER();
+    tx_busy = false;
+    uart_tx_start();
+    CRITICAL_REGION_EXIT();
+
+    baud_current = BAUD_CONFIRM;
+    uart_send_packet(PACKET_SET_BAUD, &baud_target, 1);
+}
+
+static void uart_baud_switch(void)
+{
+    uint32_t err_code = app_sched_event_put(NULL, 0, uart_baud_switch_evt_handler);
+    APP_ERROR_CHECK(err_code);
+}
+
+/**
+ * @brief 请求 CH554 使用指定的波特率，也用于在当前波特率下检查连接
+ */
+static void uart_baud_request(uint8_t index)
+{
+    baud_target = index;
+    baud_current = index == baud_index ? BAUD_CONFIRM : BAUD_REQUEST;
+    uart_send_packet(PACKET_SET_BAUD, &baud_target, 1);
+}
+
+/**
+ * @brief 回落到默认波特率，本次连接中不再尝试当前的波特率
+ */
+static void uart_baud_fallback(void)
+{
+    baud_limit = baud_index - 1;
+    baud_grace = UART_BAUD_GRACE;
+    // 通知 CH554，但不等待应答
+    baud_target = 0;
+    uart_send_packet(PACKET_SET_BAUD, &baud_target, 1);
+    uart_baud_switch();
+}
+
+/**
+ * @brief 记录一次通讯错误
+ */
+static void uart_baud_error(void)
+{
+    if (baud_index != 0 && baud_current != BAUD_CONFIRM && ++baud_errors >= UART_BAUD_ERROR_LIMIT)
+        uart_baud_fallback();
+}
+
+/**
+ * @brief 处理 CH554 对波特率请求的应答
+ *
+ * @param index CH554 接下来使用的波特率
+ */
+static void uart_baud_reply(uint8_t index)
+{
+    switch (baud_current)
+    {
+    case BAUD_REQUEST:
+        if (index == baud_target)
+        {
+            uart_baud_switch();
+        }
+        else
+        {
+            // CH554 不支持
+            baud_limit = baud_index;
+            baud_current = BAUD_IDLE;
+        }
+        break;
+    case BAUD_CONFIRM:
+        if (index == baud_index)
+            baud_current = BAUD_IDLE;
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief 波特率定时任务，在 uart_task 中检查 ping 包之前执行
+ */
+static void uart_baud_task(void)
+{
+    switch (baud_current)
+    {
+    case BAUD_REQUEST:
+        // CH554 没有应答，可能不支持协商
+        baud_limit = baud_index;
+        baud_current = BAUD_IDLE;
+        break;
+    case BAUD_CONFIRM:
+        // 新的波特率下没有应答，CH554 会自行回到默认波特率
+        baud_current = BAUD_IDLE;
+        if (baud_index != 0)
+            uart_baud_fallback();
+        ping_state = true;
+        break;
+    default:
+        if (baud_grace)
+        {
+            baud_grace--;
+            ping_state = true;
+        }
+        else if (ping_state && baud_index < baud_limit)
+            uart_baud_request(baud_index + 1);
+        else if (baud_index != 0)
+            uart_baud_request(baud_index);
+        break;
+    }
+    baud_errors = 0;
+}
+
+/**
+ * @brief 重发所有未确认的报告
+ */
+static void uart_report_resend(void)
+{
+    for (uint8_t seq = report_acked; seq != report_seq; seq++)
+        uart_send_frame(report_window[seq & UART_REPORT_MASK]);
+    report_resent = true;
+}
+
+/**
+ * @brief 有未确认的报告时启动重发定时器
+ *
+ * 定时器没有运行时才启动，到期后如果仍有未确认的报告会再次启动。
+ */
+static void uart_report_timer_start(void)
+{
+    if (report_timer_running || !report_synced || report_seq == report_acked ||
+        report_retries >= UART_RESEND_RETRIES)
+        return;
+    report_timer_acked = report_acked;
+    report_timer_running = app_timer_start(uart_resend_timer, UART_RESEND_TIMEOUT, NULL) == NRF_SUCCESS;
+}
+
+/**
+ * @brief 重发定时器到期：这段时间内确认没有前进时重发未确认的报告
+ *
+ * @param p_context
+ */
+static void uart_resend_timeout(void * p_context)
+{
+    (void)p_context;
+    report_timer_running = false;
+    if (uart_current_mode == UART_MODE_IDLE || !report_synced)
+        return;
+    if (report_seq != report_acked && report_acked == report_timer_acked)
+    {
+        report_retries++;
+        uart_report_resend();
+    }
+    uart_report_timer_start();
+}
+
+/**
+ * @brief 请求 CH554 从 report_acked 开始接收报告
+ *
+ * 在收到应答之前不发送新的报告，重复的同步包不会造成重复的按键。
+ *
+ * @param force 链路重新建立时为 true，CH554 无条件接受；
+ *              否则 CH554 已经收到的报告不会因为同步而再次接收
+ */
+static void uart_report_sync(bool force)
+{
+    uint8_t data[2] = { report_acked, force };
+
+    report_synced = false;
+    report_force = force;
+    uart_send_packet(PACKET_REPORT_SYNC, data, sizeof(data));
+}
+
+/**
+ * @brief 窗口有空位后依次放入保留的报告，键盘报告优先
+ */
+static void uart_report_release(void)
+{
+    for (uint8_t id = 0; id < UART_REPORT_TYPES && (uint8_t)(report_seq - report_acked) < UART_REPORT_WINDOW; id++)
     {
-        uint16_t id = recv.data[0];
-        memcpy(&keymap_data[id * 60], &recv.data[1], 60);
-        if (id >= 16)
+        if (report_held_mask & (1 << id))
         {
-            keymap_write();
+            report_held_mask &= ~(1 << id);
+            uart_report_put((packet_type)(PACKET_KEYBOARD + id), report_held[id], report_held_len[id]);
         }
-        uart_ack(true);
     }
 }
 
+/**
+ * @brief 处理 CH554 的累积确认
+ *
+ * @param next CH554 期待的下一个序号
+ */
+static void uart_report_ack(uint8_t next)
+{
+    uint8_t outstanding = report_seq - report_acked;
+    uint8_t progress = next - report_acked;
+
+    if (!report_synced)
+    {
+        // 同步包的应答。CH554 可能已经收到了部分报告，只重发之后的
+        if (progress <= outstanding)
+        {
+            report_acked = next;
+            report_synced = true;
+            uart_report_resend();
+            report_resent = false;
+            report_retries = 0;
+            uart_report_release();
+            uart_report_timer_start();
+        }
+    }
+    else if (progress != 0 && progress <= outstanding)
+    {
+        report_acked = next;
+        report_resent = false;
+        report_retries = 0;
+        uart_report_release();
+        uart_report_timer_start();
+    }
+    else if (progress == 0)
+    {
+        // 没有进展，说明中间有报告丢失了。每次进展之后只立即重发一次，其余由重发定时器和定时任务重发
+        if (outstanding && !report_resent)
+            uart_report_resend();
+    }
+    else if ((uint8_t)(report_acked - next) > UART_REPORT_WINDOW)
+    {
+        // 既不是新的也不是过时的确认，CH554 可能复位过
+        uart_report_sync(true);
+    }
+}
+
+/**
+ * @brief 报告定时任务：没有同步时重新同步，确认停滞时重发
+ */
+static void uart_report_task(void)
+{
+    if (!report_synced)
+        uart_report_sync(report_force);
+    else if (report_seq != report_acked && report_acked == report_checked)
+        uart_report_resend();
+    report_checked = report_acked;
+}
+
+/**
+ * @brief 回复当前的 Keymap 下载状态
+ */
+static void uart_keymap_ack(void)
+{
+    uint8_t ack[6];
+    uint16_t session;
+    uint32_t received;
+
+    received = keymap_download_status(&session);
+    uint16_encode(session, &ack[0]);
+    uint32_encode(received, &ack[2]);
+    uart_send_packet(PACKET_KEYMAP_ACK, ack, sizeof(ack));
+}
+
+/**
+ * @brief 处理Keymap下发信息
+ * 
+ * 不论是否接收都回复当前的下载状态，没有接收的包由上位机根据状态重发。
+ */
+void uart_keymap()
+{
+    if (recv.data[0] == KEYMAP_PACKET_BEGIN)
+        keymap_download_begin(uint16_decode(&recv.data[1]));
+    else
+        keymap_download(recv.data[0], &recv.data[1]);
+
+    uart_keymap_ack();
+}
+
 /**
  * @brief UART包处理
  * 
@@ -140,6 +543,13 @@ void uart_data_handler()
     case PACKET_KEYMAP:
         uart_keymap();
         break;
+    case PACKET_BAUD:
+        uart_baud_reply(recv.data[0]);
+        break;
+    case PACKET_REPORT_ACK:
+        uart_report_ack(recv.data[0]);
+        ping_state = true;
+        break;
     case PACKET_LED:
         led_val = recv.data[0];
         led_change_handler(led_val, true);
@@ -152,8 +562,10 @@ void uart_data_handler()
         { // charging
         }
         break;
-    case PACKET_FAIL:    
-        uart_send_packet((packet_type)tx_resend_buf[0], &tx_resend_buf[2], tx_resend_buf[1]);
+    case PACKET_FAIL:
+        // CH554 收到了错误的包，重发所有未确认的报告
+        if (report_synced && report_seq != report_acked)
+            uart_report_resend();
         break;
     default:
         break;
@@ -179,9 +591,11 @@ bool uart_packet_len_validator(packet_type type, uint8_t len)
         return len == 0;
     case PACKET_LED:
     case PACKET_CHARGING:
-        return len == 1;
+    case PACKET_BAUD:
+    case PACKET_REPORT_ACK:
+        return len == 3;
     case PACKET_KEYMAP:
-        return len == 62;
+        return len == 63;
     default:
         return false;
     }
@@ -190,34 +604,49 @@ bool uart_packet_len_validator(packet_type type, uint8_t len)
 /**
  * @brief UART接收事件
  * 
+ * FIFO 从空变为非空时才有事件，每次都取出所有的字节。
+ * 长度字节来自线路，波特率不匹配或受到干扰时可能是任意值，超出缓冲区的包直接丢弃，记为一次错误。
  */
 void uart_on_recv()
 {
-    switch (current)
-    {
-    case STATE_IDLE:
-        app_uart_get(&recv.len);
-        recv.pos = 0;
-        recv.data_len = recv.len - 1;
-        current = STATE_DATA;
-        break;
-    case STATE_DATA:
-    {
-        while (app_uart_get(&recv.raw[recv.pos]) == NRF_SUCCESS)
-            recv.pos++;
+    uint8_t byte;
 
-        if (recv.pos >= recv.len)
+    while (app_uart_get(&byte) == NRF_SUCCESS)
+    {
+        if (current == STATE_IDLE)
         {
-            current = STATE_IDLE;
+            if (byte == 0 || byte > sizeof(recv.raw))
+            {
+                uart_baud_error();
+                continue;
+            }
+            recv.len = byte;
+            recv.pos = 0;
+            recv.data_len = recv.len - 1;
+            current = STATE_DATA;
+            continue;
+        }
+
+        recv.raw[recv.pos++] = byte;
+        if (recv.pos < recv.len)
+            continue;
 
-            if (uart_packet_len_validator((packet_type)recv.command, recv.data_len))
-                uart_data_handler();
+        current = STATE_IDLE;
+
+        // 有数据的包包括类型在内计算 CRC，结果为 0 表示正确
+        if (uart_packet_len_validator((packet_type)recv.command, recv.data_len) &&
+            (recv.data_len == 0 || crc16_compute(recv.raw, recv.len, NULL) == 0))
+            uart_data_handler();
+        else
+        {
+            // 校验失败的 Keymap 包同样回复下载状态，上位机只认这种应答
+            if (recv.command == PACKET_KEYMAP && uart_packet_len_validator(PACKET_KEYMAP, recv.data_len))
+                uart_keymap_ack();
             else
                 uart_ack(false);
+            uart_baud_error();
         }
     }
-    break;
-    }
 }
 
 /**
@@ -234,11 +663,16 @@ void uart_evt_handler(app_uart_evt_t *p_event)
         break;
 
     case APP_UART_TX_EMPTY:
+        uart_tx_done();
         break;
 
     case APP_UART_FIFO_ERROR:
         app_uart_flush();
         break;
+
+    case APP_UART_COMMUNICATION_ERROR:
+        uart_baud_error();
+        break;
     default:
         break;
     }
@@ -253,6 +687,24 @@ void uart_to_idle()
     app_uart_close();
     nrf_gpio_cfg_input(UART_RXD, NRF_GPIO_PIN_PULLDOWN);
     uart_current_mode = UART_MODE_IDLE;
+
+    CRITICAL_REGION_ENTER();
+    tx_head = tx_tail;
+    tx_busy = false;
+    CRITICAL_REGION_EXIT();
+
+    // 重新连接时从默认波特率开始协商
+    baud_index = 0;
+    baud_limit = UART_BAUD_COUNT - 1;
+    baud_current = BAUD_IDLE;
+    baud_grace = 0;
+
+    // 链路断开后未确认的报告已经没有意义，重新连接后先同步
+    report_acked = report_seq;
+    report_checked = report_seq;
+    report_synced = false;
+    report_force = true;
+    report_held_mask = 0;
 }
 /**
  * @brief 初始化串口
@@ -269,7 +721,7 @@ void uart_init_hardware()
     buffers.tx_buf_size = sizeof(tx_buf);
 
     const app_uart_comm_params_t config = {
-        .baud_rate = UART_BAUDRATE,
+        .baud_rate = uart_baud_rates[baud_index],
         .flow_control = APP_UART_FLOW_CONTROL_DISABLED,
         .rx_pin_no = UART_RXD,
         .tx_pin_no = UART_TXD,
@@ -289,6 +741,8 @@ void uart_task(void *p_context)
     (void)p_context;
     if (uart_current_mode != UART_MODE_IDLE)
     {
+        uart_baud_task();
+        uart_report_task();
         if (!ping_state) // 没有收到ping包
         {
             uart_to_idle();
@@ -325,6 +779,11 @@ void uart_init()
     err_code = app_timer_start(uart_check_timer, UART_CHECK_INTERVAL, NULL);
     APP_ERROR_CHECK(err_code);
 
+    err_code = app_timer_create(&uart_resend_timer,
+                                APP_TIMER_MODE_SINGLE_SHOT,
+                                uart_resend_timeout);
+    APP_ERROR_CHECK(err_code);
+
     uart_to_idle();
     //uart_task(NULL);
     if (nrf_gpio_pin_read(UART_RXD)) // 状态改变了
@@ -335,17 +794,23 @@ void uart_init()
 }
 
 /**
- * @brief 发送数据
- * 
- * @param data 
- * @param len 
+ * @brief 将组好的包复制到发送队列
+ *
+ * @param frame 包，最长 UART_FRAME_REPORT 字节，返回后可以修改
  */
-void uart_send(uint8_t *data, uint8_t len)
+static void uart_send_frame(uint8_t const * frame)
 {
-    while (len--)
+    CRITICAL_REGION_ENTER();
+    if ((uint8_t)(tx_tail - tx_head) < UART_TX_QUEUE_SIZE)
     {
-        app_uart_put(*(data++));
+        memcpy(tx_queue[tx_tail++ & UART_TX_QUEUE_MASK], frame, frame[0] + 1);
+        uart_tx_start();
     }
+    else
+    {
+        uart_tx_dropped++;
+    }
+    CRITICAL_REGION_EXIT();
 }
 
 /**
@@ -353,29 +818,84 @@ void uart_send(uint8_t *data, uint8_t len)
  * 
  * @param type 包类型
  * @param data 数据
- * @param len 长度
+ * @param len 长度，最长 UART_FRAME_SMALL - 4。更长的包是调用者的错误，进入错误处理
  */
 void uart_send_packet(packet_type type, uint8_t *data, uint8_t len)
 {
-    if (uart_current_mode != UART_MODE_IDLE)
+    if (len + 4 > UART_FRAME_SMALL)
     {
-        if(len == 0)
-        {
-            app_uart_put(1);
-            app_uart_put(type);
-        }
-        else
-        {
-            app_uart_put(len + 2);
-            app_uart_put(type);
-            uart_send(data, len);
-            app_uart_put(checksum(data, len));
-        }
-        
-        tx_resend_buf[0] = type;
-        tx_resend_buf[1] = len;
-        memcpy(&tx_resend_buf[2], data, len);
+        APP_ERROR_HANDLER(NRF_ERROR_DATA_SIZE);
+        return;
+    }
+    if (uart_current_mode == UART_MODE_IDLE)
+        return;
+
+    CRITICAL_REGION_ENTER();
+    if ((uint8_t)(tx_tail - tx_head) < UART_TX_QUEUE_SIZE)
+    {
+        uint8_t * frame = tx_queue[tx_tail++ & UART_TX_QUEUE_MASK];
+
+        frame[1] = type;
+        memcpy(&frame[2], data, len);
+        uart_frame_seal(frame, len);
+        uart_tx_start();
+    }
+    else
+    {
+        uart_tx_dropped++;
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+/**
+ * @brief 给报告分配序号，在重发窗口中组包并发出，同步之前只放入窗口
+ */
+static void uart_report_put(packet_type type, uint8_t const * data, uint8_t len)
+{
+    uint8_t * frame = report_window[report_seq & UART_REPORT_MASK];
+    frame[1] = type;
+    frame[2] = report_seq;
+    memcpy(&frame[3], data, len);
+    uart_frame_seal(frame, len + 1);
+    report_seq++;
+
+    if (report_synced)
+    {
+        uart_send_frame(frame);
+        uart_report_timer_start();
+    }
+    else
+        uart_report_sync(report_force);
+}
+
+/**
+ * @brief 发送按键报告
+ *
+ * 报告带上序号直接在重发窗口中组包，同步之前只放入窗口，同步后一并发出。
+ * 窗口满时不覆盖窗口中的报告，按种类保留最新的报告，确认之后再放入窗口；
+ * 与 BLE 的报告队列一样只丢失中间状态，最终状态总是会发出。
+ *
+ * @param type 包类型，PACKET_KEYBOARD、PACKET_SYSTEM 或 PACKET_COMSUMER
+ * @param data 报告
+ * @param len 长度，最长 KEYBOARD_REPORT_SIZE
+ */
+void uart_send_report(packet_type type, uint8_t * data, uint8_t len)
+{
+    uint8_t id = type - PACKET_KEYBOARD;
+
+    if (uart_current_mode == UART_MODE_IDLE || len > KEYBOARD_REPORT_SIZE || id >= UART_REPORT_TYPES)
+        return;
+
+    if ((uint8_t)(report_seq - report_acked) >= UART_REPORT_WINDOW)
+    {
+        if (report_held_mask & (1 << id))
+            uart_report_overflow++;
+        memcpy(report_held[id], data, len);
+        report_held_len[id] = len;
+        report_held_mask |= 1 << id;
+        return;
     }
+    uart_report_put(type, data, len);
 }
 
 /**
@@ -6,15 +6,21 @@
 
 #ifdef UART_SUPPORT
 
+/**
+ * @brief 连接建立时使用的波特率，之后与 CH554 协商逐级提高到 UART_BAUDRATE_FAST
+ */
 #define UART_BAUDRATE NRF_UART_BAUDRATE_57600
+#define UART_BAUDRATE_FAST NRF_UART_BAUDRATE_250000
 
 /**
  * @brief
- * @note Packet format: Len TYPE DATA[Len-1]
- *       Len: the length of data and type, 
+ * @note Packet format: Len TYPE DATA[] CRC[2]
+ *       Len: the length of type, data and crc,
  *       Type: packet type.
- *       Data[]: data to transmit, last byte is the checksum. 
- *               if the length of data is 0, checksum can be omitted.
+ *       Data[]: data to transmit.
+ *       CRC[]: CRC-16/CCITT (0x1021, initial 0xFFFF) of TYPE and DATA, high byte first,
+ *              so the CRC of the whole packet after Len is 0.
+ *              if the length of data is 0, crc is omitted.
  * 
  */
 
@@ -25,18 +31,63 @@ typedef enum {
     PACKET_CHARGING,
     PACKET_KEYMAP,
     PACKET_USB_STATUS,
+    PACKET_BAUD,
     
     // uart tx
     PACKET_KEYBOARD = 0x80,
     PACKET_SYSTEM,
     PACKET_COMSUMER,
     PACKET_GET_STATE,
+    PACKET_SET_BAUD,
+    PACKET_REPORT_SYNC,
     
     // uart other
     PACKET_FAIL = 0xc0,
     PACKET_ACK,
+    PACKET_KEYMAP_ACK,
+    PACKET_REPORT_ACK,
 } packet_type;
 
+/**
+ * @brief Keymap 下载
+ * @note PACKET_KEYMAP data: ID DATA[60]
+ *       ID: packet index, or KEYMAP_PACKET_BEGIN to start a download,
+ *           in which case DATA[0..1] is the session chosen by the host.
+ *       The host keeps several packets in flight; each one is answered by
+ *       PACKET_KEYMAP_ACK: SESSION[2] RECEIVED[4] (little endian),
+ *       RECEIVED is the bitmap of packets stored so far. Packets missing
+ *       from the bitmap are sent again. A packet that fails the CRC is
+ *       answered the same way, without being stored.
+ *       While the previous download is still being committed, BEGIN is
+ *       refused (busy) and the reply carries the previous session; the
+ *       host waits and sends BEGIN again.
+ */
+#define KEYMAP_PACKET_BEGIN 0xff
+
+/**
+ * @brief 按键报告
+ * @note PACKET_KEYBOARD, PACKET_SYSTEM and PACKET_COMSUMER data: SEQ REPORT[].
+ *       SEQ counts reports modulo 256. The CH554 only delivers the report it expects
+ *       next, and acknowledges all reports handled in one pass with a single
+ *       PACKET_REPORT_ACK: NEXT, NEXT being the sequence it expects next.
+ *       The nRF keeps the unacknowledged reports and sends them all again
+ *       when the ack does not advance or a PACKET_FAIL arrives.
+ *       PACKET_REPORT_SYNC data: SEQ FORCE sets the sequence the CH554 expects,
+ *       it is sent after the link comes up, before any report, and answered by PACKET_REPORT_ACK.
+ */
+#define UART_REPORT_WINDOW 16
+
+/**
+ * @brief 波特率协商
+ * @note PACKET_SET_BAUD data: INDEX, index into the rate table shared by both sides.
+ *       The CH554 answers PACKET_BAUD: INDEX at the current rate and then
+ *       switches to INDEX (or stays, answering its current index, if INDEX is unknown).
+ *       The nRF switches after the answer and sends PACKET_SET_BAUD again at the new
+ *       rate to confirm. This is repeated periodically as a keep-alive; the CH554 falls
+ *       back to the first rate when nothing valid arrives for a while or after
+ *       several bad packets, and so does the nRF.
+ */
+
 typedef enum {
     UART_MODE_IDLE,         // USB 未连接
     UART_MODE_CHARGING,     // USB 已连接但尚未连接到主机
@@ -48,6 +99,7 @@ extern uart_mode uart_current_mode;
 void uart_init(void);
 void uart_sleep_prepare(void);
 void uart_send_packet(packet_type type, uint8_t * data, uint8_t len);
+void uart_send_report(packet_type type, uint8_t * data, uint8_t len);
 void uart_set_evt_handler(void (*evt)(bool));
 bool uart_is_using_usb(void);
 void uart_switch_mode(void);
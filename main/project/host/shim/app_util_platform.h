@@ -0,0 +1,23 @@
+/**
+ * @brief 主机模拟用的 app_util_platform.h，模拟环境是单线程的，临界区为空操作
+ *
+ * @file app_util_platform.h
+ */
+#ifndef APP_UTIL_PLATFORM_H__
+#define APP_UTIL_PLATFORM_H__
+
+#include <stdint.h>
+#include "compiler_abstraction.h"
+#include "nrf.h"
+#include "app_error.h"
+
+typedef enum
+{
+    APP_IRQ_PRIORITY_HIGH    = 1,
+    APP_IRQ_PRIORITY_LOW     = 3
+} app_irq_priority_t;
+
+#define CRITICAL_REGION_ENTER()
+#define CRITICAL_REGION_EXIT()
+
+#endif
@@ -0,0 +1,20 @@
+/**
+ * @brief 主机模拟用的 ble_hid_service.h，实现见 sim_ble.c
+ *
+ * @file ble_hid_service.h
+ */
+#ifndef __HIDS_H__
+#define __HIDS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+void hids_init(void);
+
+void hids_keys_send(uint8_t key_pattern_len, uint8_t *p_key_pattern);
+void hids_system_key_send(uint8_t key_pattern_len, uint8_t *p_key_pattern);
+void hids_consumer_key_send(uint8_t key_pattern_len, uint8_t *p_key_pattern);
+
+extern uint8_t led_val;
+
+#endif
@@ -0,0 +1,14 @@
+/**
+ * @brief 主机模拟用的 ble_services.h，实现见 sim_ble.c
+ *
+ * @file ble_services.h
+ */
+#ifndef __BLE_SERVICES__
+#define __BLE_SERVICES__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+void ble_host_switch(uint8_t slot);
+
+#endif
@@ -0,0 +1,18 @@
+/**
+ * @brief 主机模拟用的 main.h，替代 main/ble/main.h
+ *
+ * @file main.h
+ */
+#ifndef __MAIN_H__
+#define __MAIN_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define APP_TIMER_PRESCALER 0     /**< Value of the RTC1 PRESCALER register. */
+#define APP_TIMER_OP_QUEUE_SIZE 8 /**< Size of timer operation queues. */
+
+void service_error_handler(uint32_t nrf_error);
+void sleep_mode_enter(bool notice);
+
+#endif
@@ -0,0 +1,50 @@
+/**
+ * @brief 主机模拟用的 nrf.h
+ *
+ * 只声明键盘代码实际用到的 GPIO 与 GPIOTE 外设。寄存器访问通过 sim_gpio_access()
+ * 转发到 sim_gpio.c 中的阵列模型，以便统计每次扫描的寄存器访问次数。
+ *
+ * @file nrf.h
+ */
+#ifndef NRF_H
+#define NRF_H
+
+#include <stdint.h>
+#include "nrf51_bitfields.h"
+#include "compiler_abstraction.h"
+
+#ifndef __STATIC_INLINE
+#define __STATIC_INLINE static inline
+#endif
+
+typedef struct
+{
+    volatile uint32_t OUT;
+    volatile uint32_t OUTSET;
+    volatile uint32_t OUTCLR;
+    volatile uint32_t IN;
+    volatile uint32_t DIR;
+    volatile uint32_t DIRSET;
+    volatile uint32_t DIRCLR;
+    volatile uint32_t PIN_CNF[32];
+} NRF_GPIO_Type;
+
+typedef struct
+{
+    volatile uint32_t EVENTS_PORT;
+    volatile uint32_t INTENSET;
+    volatile uint32_t INTENCLR;
+} NRF_GPIOTE_Type;
+
+typedef enum
+{
+    GPIOTE_IRQn = 6,
+} IRQn_Type;
+
+NRF_GPIO_Type * sim_gpio_access(void);
+NRF_GPIOTE_Type * sim_gpiote_access(void);
+
+#define NRF_GPIO (sim_gpio_access())
+#define NRF_GPIOTE (sim_gpiote_access())
+
+#endif
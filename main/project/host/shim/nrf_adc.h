@@ -0,0 +1,22 @@
+/**
+ * @brief 主机模拟用的 nrf_adc.h，只提供 keyboard_conf.h 需要的输入定义
+ *
+ * @file nrf_adc.h
+ */
+#ifndef NRF_ADC_H_
+#define NRF_ADC_H_
+
+typedef enum
+{
+    NRF_ADC_CONFIG_INPUT_DISABLED,
+    NRF_ADC_CONFIG_INPUT_0,
+    NRF_ADC_CONFIG_INPUT_1,
+    NRF_ADC_CONFIG_INPUT_2,
+    NRF_ADC_CONFIG_INPUT_3,
+    NRF_ADC_CONFIG_INPUT_4,
+    NRF_ADC_CONFIG_INPUT_5,
+    NRF_ADC_CONFIG_INPUT_6,
+    NRF_ADC_CONFIG_INPUT_7,
+} nrf_adc_config_input_t;
+
+#endif
@@ -0,0 +1,21 @@
+/**
+ * @brief 主机模拟用的 nrf_delay.h，延时不消耗模拟时间
+ *
+ * @file nrf_delay.h
+ */
+#ifndef _NRF_DELAY_H
+#define _NRF_DELAY_H
+
+#include <stdint.h>
+
+static inline void nrf_delay_us(uint32_t volatile number_of_us)
+{
+    (void)number_of_us;
+}
+
+static inline void nrf_delay_ms(uint32_t volatile number_of_ms)
+{
+    (void)number_of_ms;
+}
+
+#endif
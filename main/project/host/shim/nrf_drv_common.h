@@ -0,0 +1,14 @@
+/**
+ * @brief 主机模拟用的 nrf_drv_common.h，中断由 sim_gpio.c 直接调用
+ *
+ * @file nrf_drv_common.h
+ */
+#ifndef NRF_DRV_COMMON_H__
+#define NRF_DRV_COMMON_H__
+
+#include <stdint.h>
+#include "nrf.h"
+
+void nrf_drv_common_irq_enable(IRQn_Type IRQn, uint8_t priority);
+
+#endif
@@ -0,0 +1,35 @@
+/**
+ * @brief 主机模拟用的 pstorage 平台定义，与 main/config/pstorage_platform.h 保持一致
+ *
+ * @file pstorage_platform.h
+ */
+#ifndef PSTORAGE_PL_H__
+#define PSTORAGE_PL_H__
+
+#include <stdint.h>
+
+#define PSTORAGE_FLASH_PAGE_SIZE     1024                                /**< nRF51 的页大小 */
+#define PSTORAGE_FLASH_EMPTY_MASK    0xFFFFFFFF
+
+#define PSTORAGE_NUM_OF_PAGES       5
+#define PSTORAGE_MIN_BLOCK_SIZE     0x0010
+#define PSTORAGE_MAX_BLOCK_SIZE     PSTORAGE_FLASH_PAGE_SIZE
+#define PSTORAGE_CMD_QUEUE_SIZE     10
+
+typedef uint32_t pstorage_block_t;
+
+/** 模拟的 flash 是一个数组，block_id 是其中的偏移 */
+uint8_t const * sim_pstorage_address(pstorage_block_t block_id);
+#define PSTORAGE_BLOCK_ADDRESS(ID)  sim_pstorage_address(ID)
+
+typedef struct
+{
+    uint32_t            module_id;
+    pstorage_block_t    block_id;
+} pstorage_handle_t;
+
+typedef uint16_t pstorage_size_t;
+
+void pstorage_sys_event_handler (uint32_t sys_evt);
+
+#endif
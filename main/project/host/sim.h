@@ -0,0 +1,56 @@
+/**
+ * @brief 主机模拟环境的公共接口
+ *
+ * @file sim.h
+ */
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/** 模拟用的 nRF51 flash 耗时（标称值，us） */
+#define SIM_FLASH_PAGE_ERASE_US 22300
+#define SIM_FLASH_WORD_WRITE_US 46
+
+/**
+ * @brief 模拟的 flash 操作统计
+ */
+typedef struct
+{
+    uint32_t page_erase;  /**< 页擦除次数 */
+    uint32_t word_write;  /**< 字写入次数 */
+} sim_flash_stats_t;
+
+extern sim_flash_stats_t sim_flash_stats;
+
+/** sim_pstorage.c */
+void sim_pstorage_reboot(void);
+void sim_pstorage_power_cut(uint32_t words);
+
+/** sim_gpio.c */
+void sim_gpio_init(void);
+void sim_matrix_set(uint8_t row, uint8_t col, bool pressed);
+bool sim_matrix_get(uint8_t row, uint8_t col);
+uint32_t sim_gpio_access_count(void);
+uint32_t sim_gpio_irq_count(void);
+void sim_gpio_set_settle(uint8_t accesses);
+void GPIOTE_IRQHandler(void);
+
+/** sim_timer.c */
+void sim_timer_advance(uint32_t ticks);
+uint32_t sim_timer_now(void);
+
+/** usb/crc.c，CH554 的查表 CRC */
+uint16_t crc16(uint16_t crc, uint8_t *data, uint8_t len);
+
+/** sim_radio.c */
+void sim_radio_key(void);
+void sim_radio_report(void);
+void sim_radio_print(bool verbose);
+
+/** sim_ble.c */
+extern uint32_t sim_keyboard_reports;
+extern uint32_t sim_extra_reports;
+
+#endif
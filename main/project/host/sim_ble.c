@@ -0,0 +1,65 @@
+/**
+ * @brief 模拟 HID 服务与 UART 驱动
+ *
+ * 只统计发出的报告数量，报告的内容由 sim_main.c 通过 hook_send_keyboard 检查。
+ *
+ * @file sim_ble.c
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble_hid_service.h"
+#include "ble_services.h"
+#include "uart_driver.h"
+#include "sim.h"
+
+uint8_t led_val = 0;
+
+uint32_t sim_keyboard_reports;
+uint32_t sim_extra_reports;
+
+void hids_init(void)
+{
+}
+
+void hids_keys_send(uint8_t key_pattern_len, uint8_t *p_key_pattern)
+{
+    sim_keyboard_reports++;
+    sim_radio_report();
+}
+
+void hids_system_key_send(uint8_t key_pattern_len, uint8_t *p_key_pattern)
+{
+    sim_extra_reports++;
+    sim_radio_report();
+}
+
+void hids_consumer_key_send(uint8_t key_pattern_len, uint8_t *p_key_pattern)
+{
+    sim_extra_reports++;
+    sim_radio_report();
+}
+
+void ble_host_switch(uint8_t slot)
+{
+}
+
+#ifdef UART_SUPPORT
+uart_mode uart_current_mode = UART_MODE_IDLE;
+
+bool uart_is_using_usb(void)
+{
+    return false;
+}
+
+void uart_send_packet(packet_type type, uint8_t * data, uint8_t len)
+{
+}
+
+void uart_send_report(packet_type type, uint8_t * data, uint8_t len)
+{
+}
+
+void uart_switch_mode(void)
+{
+}
+#endif
@@ -0,0 +1,304 @@
+/**
+ * @brief 模拟 GPIO 与按键阵列
+ *
+ * 按 PIN_CNF 的方向、驱动和上下拉配置计算 IN 寄存器的值。按下的按键把
+ * 行线和列线连在一起；定义了 MATRIX_GHOST_FILTER 的阵列没有二极管，按键之间
+ * 的通路会相互传递，因此能重现鬼键。
+ *
+ * 开启了 SENSE 的引脚满足条件时 DETECT 信号拉高，其上升沿产生 GPIOTE PORT 事件，
+ * 中断使能时在 sim_matrix_set() 中调用 GPIOTE_IRQHandler()。
+ *
+ * 只靠上下拉电阻决定电平的引脚翻转较慢，sim_gpio_set_settle() 设置它的新电平
+ * 要经过多少次寄存器访问才出现在 IN 中，用来模拟走线较长的板子。
+ *
+ * @file sim_gpio.c
+ */
+#include <string.h>
+#include "nrf.h"
+#include "nrf_gpio.h"
+#include "keyboard_conf.h"
+#include "sim.h"
+
+#define PIN_COUNT 32
+#define LEVEL_NONE (-1)
+
+static NRF_GPIO_Type gpio;
+static NRF_GPIOTE_Type gpiote;
+static bool detect;
+static bool irq_enabled;
+static uint32_t irq_count;
+static uint32_t out_shadow;
+static uint32_t cnf_shadow[PIN_COUNT];
+static bool key_state[MATRIX_ROWS][MATRIX_COLS];
+static bool dirty = true;
+static uint32_t access_count;
+static uint32_t in_target;
+static uint32_t in_driven;
+static uint8_t settle_left[PIN_COUNT];
+static uint8_t settle_accesses;
+
+/**
+ * @brief 引脚当前驱动的电平
+ *
+ * @return 1 或 0 表示输出高/低，LEVEL_NONE 表示输入或高阻
+ */
+static int8_t drive_level(uint8_t pin)
+{
+    uint32_t cnf = gpio.PIN_CNF[pin];
+    uint32_t drive = (cnf & GPIO_PIN_CNF_DRIVE_Msk) >> GPIO_PIN_CNF_DRIVE_Pos;
+
+    if (((cnf & GPIO_PIN_CNF_DIR_Msk) >> GPIO_PIN_CNF_DIR_Pos) != GPIO_PIN_CNF_DIR_Output)
+        return LEVEL_NONE;
+
+    if (gpio.OUT & (1UL << pin))
+        return (drive == GPIO_PIN_CNF_DRIVE_S0D1 || drive == GPIO_PIN_CNF_DRIVE_H0D1) ? LEVEL_NONE : 1;
+    else
+        return (drive == GPIO_PIN_CNF_DRIVE_D0S1 || drive == GPIO_PIN_CNF_DRIVE_D0H1) ? LEVEL_NONE : 0;
+}
+
+static int8_t pull_level(uint8_t pin)
+{
+    uint32_t pull = (gpio.PIN_CNF[pin] & GPIO_PIN_CNF_PULL_Msk) >> GPIO_PIN_CNF_PULL_Pos;
+    return pull == GPIO_PIN_CNF_PULL_Pullup ? 1 : 0;
+}
+
+#ifdef MATRIX_GHOST_FILTER
+static uint8_t net_find(uint8_t * root, uint8_t pin)
+{
+    while (root[pin] != pin)
+        pin = root[pin] = root[root[pin]];
+    return pin;
+}
+#endif
+
+/**
+ * @brief 根据引脚配置和按键状态计算每个引脚的电平
+ */
+static void net_resolve(int8_t * level)
+{
+#ifdef MATRIX_GHOST_FILTER
+    uint8_t root[PIN_COUNT];
+    int8_t net_level[PIN_COUNT];
+
+    for (uint8_t i = 0; i < PIN_COUNT; i++)
+    {
+        root[i] = i;
+        net_level[i] = LEVEL_NONE;
+    }
+    for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+        for (uint8_t c = 0; c < MATRIX_COLS; c++)
+            if (key_state[r][c])
+                root[net_find(root, row_pin_array[r])] = net_find(root, column_pin_array[c]);
+
+    for (uint8_t i = 0; i < PIN_COUNT; i++)
+    {
+        int8_t d = drive_level(i);
+        if (d != LEVEL_NONE)
+            net_level[net_find(root, i)] = d;
+    }
+    for (uint8_t i = 0; i < PIN_COUNT; i++)
+        level[i] = net_level[net_find(root, i)];
+#else
+    // 有二极管的阵列：只有直接相连的行列之间有通路
+    for (uint8_t i = 0; i < PIN_COUNT; i++)
+        level[i] = drive_level(i);
+
+    for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+    {
+        for (uint8_t c = 0; c < MATRIX_COLS; c++)
+        {
+            if (!key_state[r][c])
+                continue;
+            uint8_t row = row_pin_array[r], col = column_pin_array[c];
+            int8_t d_row = drive_level(row), d_col = drive_level(col);
+            if (level[col] == LEVEL_NONE && d_row != LEVEL_NONE)
+                level[col] = d_row;
+            if (level[row] == LEVEL_NONE && d_col != LEVEL_NONE)
+                level[row] = d_col;
+        }
+    }
+#endif
+}
+
+static void gpio_update(void)
+{
+    int8_t level[PIN_COUNT];
+    uint32_t in = 0, dir = 0, driven = 0;
+
+    net_resolve(level);
+    for (uint8_t i = 0; i < PIN_COUNT; i++)
+    {
+        uint32_t cnf = gpio.PIN_CNF[i];
+        if (((cnf & GPIO_PIN_CNF_DIR_Msk) >> GPIO_PIN_CNF_DIR_Pos) == GPIO_PIN_CNF_DIR_Output)
+            dir |= 1UL << i;
+        if (((cnf & GPIO_PIN_CNF_INPUT_Msk) >> GPIO_PIN_CNF_INPUT_Pos) != GPIO_PIN_CNF_INPUT_Connect)
+            continue;
+        if (level[i] != LEVEL_NONE)
+            driven |= 1UL << i;
+        if ((level[i] == LEVEL_NONE ? pull_level(i) : level[i]) == 1)
+            in |= 1UL << i;
+    }
+    in_target = in;
+    in_driven = driven;
+    gpio.DIR = dir;
+
+    bool new_detect = false;
+    for (uint8_t i = 0; i < PIN_COUNT; i++)
+    {
+        uint32_t sense = (gpio.PIN_CNF[i] & GPIO_PIN_CNF_SENSE_Msk) >> GPIO_PIN_CNF_SENSE_Pos;
+        if ((sense == GPIO_PIN_CNF_SENSE_High && (in & (1UL << i))) ||
+            (sense == GPIO_PIN_CNF_SENSE_Low && !(in & (1UL << i))))
+            new_detect = true;
+    }
+    if (new_detect && !detect)
+        gpiote.EVENTS_PORT = 1;
+    detect = new_detect;
+}
+
+/**
+ * @brief 应用上一次访问写入的寄存器，并在需要时重新计算 IN
+ */
+static void gpio_sync(void)
+{
+    if (gpio.OUTSET)
+    {
+        gpio.OUT |= gpio.OUTSET;
+        gpio.OUTSET = 0;
+    }
+    if (gpio.OUTCLR)
+    {
+        gpio.OUT &= ~gpio.OUTCLR;
+        gpio.OUTCLR = 0;
+    }
+    for (uint8_t i = 0; i < PIN_COUNT; i++)
+    {
+        if (gpio.DIRSET & (1UL << i))
+            gpio.PIN_CNF[i] |= GPIO_PIN_CNF_DIR_Msk;
+        if (gpio.DIRCLR & (1UL << i))
+            gpio.PIN_CNF[i] &= ~GPIO_PIN_CNF_DIR_Msk;
+    }
+    gpio.DIRSET = gpio.DIRCLR = 0;
+
+    if (gpio.OUT != out_shadow || memcmp(cnf_shadow, (const void *)gpio.PIN_CNF, sizeof(cnf_shadow)))
+    {
+        out_shadow = gpio.OUT;
+        memcpy(cnf_shadow, (const void *)gpio.PIN_CNF, sizeof(cnf_shadow));
+        dirty = true;
+    }
+    if (dirty)
+    {
+        gpio_update();
+        dirty = false;
+    }
+}
+
+/**
+ * @brief 把引脚的新电平更新到 IN，只靠上下拉的引脚延迟 settle_accesses 次访问
+ */
+static void gpio_settle(void)
+{
+    uint32_t diff = gpio.IN ^ in_target;
+
+    for (uint8_t i = 0; i < PIN_COUNT; i++)
+    {
+        uint32_t mask = 1UL << i;
+        if (!(diff & mask))
+        {
+            settle_left[i] = 0;
+            continue;
+        }
+        if ((in_driven & mask) || settle_accesses == 0)
+            settle_left[i] = 1;
+        else if (settle_left[i] == 0)
+        {
+            settle_left[i] = settle_accesses;
+            continue;
+        }
+        if (--settle_left[i] == 0)
+            gpio.IN ^= mask;
+    }
+}
+
+/**
+ * @brief 固件通过 NRF_GPIO 宏访问寄存器的入口
+ */
+NRF_GPIO_Type * sim_gpio_access(void)
+{
+    access_count++;
+    gpio_sync();
+    gpio_settle();
+    return &gpio;
+}
+
+void sim_gpio_set_settle(uint8_t accesses)
+{
+    settle_accesses = accesses;
+}
+
+NRF_GPIOTE_Type * sim_gpiote_access(void)
+{
+    if (gpiote.INTENCLR)
+    {
+        gpiote.INTENSET &= ~gpiote.INTENCLR;
+        gpiote.INTENCLR = 0;
+    }
+    return &gpiote;
+}
+
+void nrf_drv_common_irq_enable(IRQn_Type IRQn, uint8_t priority)
+{
+    if (IRQn == GPIOTE_IRQn)
+        irq_enabled = true;
+}
+
+/**
+ * @brief 若有挂起的 PORT 中断则调用中断处理函数
+ */
+static void gpiote_irq_poll(void)
+{
+    sim_gpiote_access();
+    if (irq_enabled && gpiote.EVENTS_PORT && (gpiote.INTENSET & GPIOTE_INTENSET_PORT_Msk))
+    {
+        irq_count++;
+        GPIOTE_IRQHandler();
+    }
+}
+
+void sim_gpio_init(void)
+{
+    memset((void *)&gpio, 0, sizeof(gpio));
+    memset((void *)&gpiote, 0, sizeof(gpiote));
+    detect = false;
+    for (uint8_t i = 0; i < PIN_COUNT; i++)
+        gpio.PIN_CNF[i] = GPIO_PIN_CNF_INPUT_Disconnect << GPIO_PIN_CNF_INPUT_Pos;
+    memset(key_state, 0, sizeof(key_state));
+    memset(settle_left, 0, sizeof(settle_left));
+    dirty = true;
+    gpio_sync();
+    gpio.IN = in_target;
+}
+
+void sim_matrix_set(uint8_t row, uint8_t col, bool pressed)
+{
+    if (row >= MATRIX_ROWS || col >= MATRIX_COLS || key_state[row][col] == pressed)
+        return;
+    key_state[row][col] = pressed;
+    dirty = true;
+    gpio_sync();
+    gpiote_irq_poll();
+}
+
+bool sim_matrix_get(uint8_t row, uint8_t col)
+{
+    return key_state[row][col];
+}
+
+uint32_t sim_gpio_access_count(void)
+{
+    return access_count;
+}
+
+uint32_t sim_gpio_irq_count(void)
+{
+    return irq_count;
+}
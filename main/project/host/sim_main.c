@@ -0,0 +1,1300 @@
+/**
+ * @brief 键盘固件主机模拟入口
+ *
+ * 在 Linux 上运行 matrix.c、keymap_storage.c、host_driver.c 等键盘代码，
+ * 按扫描周期回放按键轨迹，统计每个按键事件从触点动作到发出报告的延迟（以扫描周期计），
+ * 以及每次扫描消耗的主机 CPU 周期与 GPIO 寄存器访问次数。
+ * 扫描由 keyboard_scan.c 的定时器和按键唤醒中断驱动，与固件一致。
+ *
+ * 轨迹文件每行一个事件： <时间> down|up <行> <列> [抖动次数]
+ * 时间以 KEYBOARD_FAST_SCAN_INTERVAL 为单位，事件发生在两次定时扫描的中间。
+ * 抖动次数表示触点在之后的若干次扫描中来回跳变，以 # 开头的行为注释。
+ *
+ * @file sim_main.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "main.h"
+#include "app_timer.h"
+#include "pstorage.h"
+#include "keyboard_conf.h"
+#include "keyboard.h"
+#include "keymap.h"
+#include "keycode.h"
+#include "action_layer.h"
+#include "nordic_common.h"
+#include "host.h"
+#include "keyboard_led.h"
+#include "keyboard_scan.h"
+#include "matrix.h"
+#include "keyboard_matrix.h"
+#include "app_scheduler.h"
+#include "keyboard_host_driver.h"
+#include "keymap_storage.h"
+#include "hook.h"
+#include "custom_hook.h"
+#include "eeconfig.h"
+#include "storage.h"
+#include "crc16.h"
+#include "report_queue.h"
+#include "sim.h"
+
+#define MAX_TRACE_EVENTS 65536
+#define MAX_PENDING 4
+#define IDLE_TAIL_SCANS 100
+#define SCAN_TICKS APP_TIMER_TICKS(KEYBOARD_FAST_SCAN_INTERVAL, APP_TIMER_PRESCALER)
+
+typedef struct
+{
+    uint32_t tick;
+    uint8_t row;
+    uint8_t col;
+    bool pressed;
+    uint8_t chatter;
+} trace_event_t;
+
+typedef struct
+{
+    uint32_t time;     /**< 触点动作的 RTC 时间 */
+    uint8_t keycode;
+    bool pressed;
+} pending_event_t;
+
+typedef struct
+{
+    pending_event_t event[MAX_PENDING];
+    uint8_t count;
+    uint8_t chatter;   /**< 剩余的抖动扫描次数 */
+    bool level;        /**< 稳定后的触点状态 */
+} key_track_t;
+
+static trace_event_t trace[MAX_TRACE_EVENTS];
+static uint32_t trace_len;
+
+static key_track_t track[MATRIX_ROWS][MATRIX_COLS];
+static uint32_t latency[MAX_TRACE_EVENTS];
+static uint32_t latency_count;
+static uint32_t event_count, tracked_count, lost_count;
+
+static uint32_t scan_tick;
+static uint64_t scan_cycles, task_cycles;
+static uint32_t scan_count, scan_gpio, task_count, modified_count;
+static uint32_t sleep_count;
+static uint32_t phantom_count;
+static bool verbose;
+/** 回放结束后输出射频功耗与发送延迟 */
+static bool radio_trace;
+
+static inline uint64_t cycles_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+void app_error_handler(uint32_t error_code, uint32_t line_num, const uint8_t * p_file_name)
+{
+    fprintf(stderr, "app_error 0x%08x at %s:%u\n", error_code, p_file_name ? (const char *)p_file_name : "?", line_num);
+    exit(2);
+}
+
+void service_error_handler(uint32_t nrf_error)
+{
+    APP_ERROR_HANDLER(nrf_error);
+}
+
+void sleep_mode_enter(bool notice)
+{
+    sleep_count++;
+}
+
+/**
+ * @brief 检查新按下的按键在扫描时是否真的闭合，否则就是没有被过滤的鬼键
+ */
+static void phantom_check(void)
+{
+    static matrix_row_t last[MATRIX_ROWS];
+
+    for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+    {
+        matrix_row_t row = matrix_get_row(r);
+        matrix_row_t pressed = row & ~last[r];
+        last[r] = row;
+
+        for (uint8_t c = 0; pressed; c++, pressed >>= 1)
+        {
+            if ((pressed & 1) && !sim_matrix_get(r, c))
+            {
+                phantom_count++;
+                if (verbose)
+                    printf("tick %u: phantom key %u,%u\n", scan_tick, r, c);
+            }
+        }
+    }
+}
+
+/**
+ * @brief 统计 matrix_scan 的开销，链接时通过 --wrap 替换
+ */
+uint8_t __real_matrix_scan(void);
+uint8_t __wrap_matrix_scan(void)
+{
+    uint32_t gpio = sim_gpio_access_count();
+    uint64_t start = cycles_now();
+    uint8_t ret = __real_matrix_scan();
+    scan_cycles += cycles_now() - start;
+    scan_gpio += sim_gpio_access_count() - gpio;
+    scan_count++;
+    if (matrix_is_changed())
+    {
+        modified_count++;
+        phantom_check();
+    }
+    return ret;
+}
+
+void __real_keyboard_task(void);
+void __wrap_keyboard_task(void)
+{
+    uint64_t start = cycles_now();
+    __real_keyboard_task();
+    task_cycles += cycles_now() - start;
+    task_count++;
+}
+
+/**
+ * @brief 按当前的层状态取得按键的键码
+ */
+static uint8_t resolve_keycode(uint8_t row, uint8_t col)
+{
+    uint32_t layers = layer_state | default_layer_state;
+    keypos_t key = { .col = col, .row = row };
+
+    for (int8_t i = 31; i >= 0; i--)
+    {
+        if (layers & (1UL << i))
+        {
+            uint8_t code = keymap_key_to_keycode(i, key);
+            if (code != KC_TRNS)
+                return code;
+        }
+    }
+    return keymap_key_to_keycode(0, key);
+}
+
+static bool report_has(report_keyboard_t * report, uint8_t code)
+{
+    if (IS_MOD(code))
+        return report->mods & MOD_BIT(code);
+    for (uint8_t i = 0; i < KEYBOARD_REPORT_KEYS; i++)
+        if (report->keys[i] == code)
+            return true;
+    return false;
+}
+
+void hook_matrix_change(keyevent_t event)
+{
+    sim_radio_key();
+}
+
+void hook_send_keyboard(report_keyboard_t * report)
+{
+    for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+    {
+        for (uint8_t c = 0; c < MATRIX_COLS; c++)
+        {
+            key_track_t * t = &track[r][c];
+            while (t->count && report_has(report, t->event[0].keycode) == t->event[0].pressed)
+            {
+                uint32_t delta = sim_timer_now() - t->event[0].time;
+                latency[latency_count++] = delta;
+                if (verbose)
+                    printf("tick %u: key %u,%u %s latency %.2f scans\n", scan_tick, r, c,
+                           t->event[0].pressed ? "down" : "up", (double)delta / SCAN_TICKS);
+                memmove(&t->event[0], &t->event[1], sizeof(pending_event_t) * (--t->count));
+            }
+        }
+    }
+}
+
+/**
+ * @brief 记录一个逻辑按键事件。若同一按键上还有未发出的相反事件，则两者都视为丢失
+ */
+static void track_event(trace_event_t * e)
+{
+    key_track_t * t = &track[e->row][e->col];
+    uint8_t code = e->pressed ? resolve_keycode(e->row, e->col) : KC_NO;
+
+    event_count++;
+    if (!e->pressed)
+    {
+        // 释放事件对应最近一次按下的键码
+        for (int8_t i = t->count - 1; i >= 0 && code == KC_NO; i--)
+            code = t->event[i].keycode;
+        if (code == KC_NO)
+            code = resolve_keycode(e->row, e->col);
+    }
+    if (!IS_KEY(code) && !IS_MOD(code))
+        return;
+
+    tracked_count++;
+    if (t->count && t->event[t->count - 1].pressed != e->pressed)
+    {
+        // 上一次动作还没体现在报告里就被撤销了
+        t->count--;
+        lost_count += 2;
+        tracked_count -= 2;
+        return;
+    }
+    if (t->count < MAX_PENDING)
+    {
+        t->event[t->count].time = sim_timer_now();
+        t->event[t->count].keycode = code;
+        t->event[t->count].pressed = e->pressed;
+        t->count++;
+    }
+}
+
+static void trace_apply(uint32_t * pos)
+{
+    // 处理抖动中的按键
+    for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+    {
+        for (uint8_t c = 0; c < MATRIX_COLS; c++)
+        {
+            key_track_t * t = &track[r][c];
+            if (t->chatter)
+            {
+                t->chatter--;
+                sim_matrix_set(r, c, t->chatter % 2 ? !t->level : t->level);
+            }
+        }
+    }
+
+    while (*pos < trace_len && trace[*pos].tick <= scan_tick)
+    {
+        trace_event_t * e = &trace[(*pos)++];
+        key_track_t * t = &track[e->row][e->col];
+
+        if (e->row >= MATRIX_ROWS || e->col >= MATRIX_COLS || t->level == e->pressed)
+            continue;
+
+        t->level = e->pressed;
+        t->chatter = e->chatter * 2;
+        sim_matrix_set(e->row, e->col, e->pressed);
+        track_event(e);
+    }
+}
+
+static bool trace_load(const char * path)
+{
+    FILE * fp = fopen(path, "r");
+    char line[128];
+
+    if (fp == NULL)
+    {
+        perror(path);
+        return false;
+    }
+    while (fgets(line, sizeof(line), fp) && trace_len < MAX_TRACE_EVENTS)
+    {
+        trace_event_t e = {0};
+        unsigned tick, row, col, chatter = 0;
+        char action[8];
+
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%u %7s %u %u %u", &tick, action, &row, &col, &chatter) < 4)
+        {
+            fprintf(stderr, "%s: bad line: %s", path, line);
+            continue;
+        }
+        e.tick = tick;
+        e.row = row;
+        e.col = col;
+        e.pressed = strcmp(action, "down") == 0;
+        e.chatter = chatter;
+        trace[trace_len++] = e;
+    }
+    fclose(fp);
+    return true;
+}
+
+/**
+ * @brief 生成随机打字轨迹，同时最多按住两个按键
+ */
+static void trace_random(uint32_t count, uint32_t seed)
+{
+    keypos_t keys[MATRIX_ROWS * MATRIX_COLS];
+    uint32_t key_count = 0, tick = 10;
+    keypos_t held[2];
+    uint32_t release[2] = {0};
+    uint8_t held_count = 0;
+
+    srand(seed);
+    for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+    {
+        for (uint8_t c = 0; c < MATRIX_COLS; c++)
+        {
+            keypos_t key = { .col = c, .row = r };
+            if (IS_KEY(keymap_key_to_keycode(0, key)))
+                keys[key_count++] = key;
+        }
+    }
+
+    while (count-- && trace_len + 4 < MAX_TRACE_EVENTS)
+    {
+        keypos_t key;
+        bool busy;
+
+        // 先释放已到时间的按键
+        for (uint8_t i = 0; i < held_count;)
+        {
+            if (release[i] <= tick || held_count == 2)
+            {
+                trace[trace_len++] = (trace_event_t){ release[i] > tick ? release[i] : tick, held[i].row, held[i].col, false, rand() % 3 };
+                tick = trace[trace_len - 1].tick + 1;
+                held[i] = held[--held_count];
+                release[i] = release[held_count];
+            }
+            else
+                i++;
+        }
+
+        do
+        {
+            key = keys[rand() % key_count];
+            busy = held_count && KEYEQ(key, held[0]);
+        } while (busy);
+
+        trace[trace_len++] = (trace_event_t){ tick, key.row, key.col, true, rand() % 3 };
+        held[held_count] = key;
+        release[held_count++] = tick + 3 + rand() % 12;
+        tick += 1 + rand() % 10;
+    }
+    for (uint8_t i = 0; i < held_count; i++)
+    {
+        trace[trace_len++] = (trace_event_t){ release[i] > tick ? release[i] : tick, held[i].row, held[i].col, false, 0 };
+        tick = trace[trace_len - 1].tick + 1;
+    }
+}
+
+static int latency_cmp(const void * a, const void * b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report_print(void)
+{
+    uint32_t pending = 0;
+    uint64_t sum = 0;
+
+    for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+        for (uint8_t c = 0; c < MATRIX_COLS; c++)
+            pending += track[r][c].count;
+
+    printf("scans=%u\n", scan_count);
+    printf("events=%u\n", event_count);
+    printf("tracked=%u\n", tracked_count);
+    printf("lost=%u\n", lost_count + pending);
+
+    if (latency_count)
+    {
+        qsort(latency, latency_count, sizeof(latency[0]), latency_cmp);
+        for (uint32_t i = 0; i < latency_count; i++)
+            sum += latency[i];
+        printf("latency_scans_min=%.2f\n", (double)latency[0] / SCAN_TICKS);
+        printf("latency_scans_avg=%.2f\n", (double)sum / latency_count / SCAN_TICKS);
+        printf("latency_scans_p50=%.2f\n", (double)latency[latency_count / 2] / SCAN_TICKS);
+        printf("latency_scans_p99=%.2f\n", (double)latency[latency_count * 99 / 100] / SCAN_TICKS);
+        printf("latency_scans_max=%.2f\n", (double)latency[latency_count - 1] / SCAN_TICKS);
+        printf("latency_ms_avg=%.1f\n", (double)sum * 1000 / APP_TIMER_CLOCK_FREQ / latency_count);
+        printf("latency_ms_max=%.1f\n", (double)latency[latency_count - 1] * 1000 / APP_TIMER_CLOCK_FREQ);
+    }
+    if (scan_count)
+    {
+        printf("matrix_scan_cycles_per_scan=%.1f\n", (double)scan_cycles / scan_count);
+        printf("matrix_scan_gpio_per_scan=%.1f\n", (double)scan_gpio / scan_count);
+    }
+    if (task_count)
+        printf("keyboard_task_cycles_per_scan=%.1f\n", (double)task_cycles / task_count);
+    printf("modified_scans=%u\n", modified_count);
+    printf("scan_duty=%.3f\n", (double)scan_count / scan_tick);
+    printf("key_wakeups=%u\n", sim_gpio_irq_count());
+    printf("keyboard_reports=%u\n", sim_keyboard_reports);
+    printf("phantom_keys=%u\n", phantom_count);
+    printf("flash_erase=%u\n", sim_flash_stats.page_erase);
+    printf("flash_word_write=%u\n", sim_flash_stats.word_write);
+    printf("sleep_enter=%u\n", sleep_count);
+}
+
+static void usage(const char * name)
+{
+    fprintf(stderr, "usage: %s [-v] [-p] [-d settle] [-r count] [-s seed] [trace]\n", name);
+    fprintf(stderr, "       %s -e count [-s seed]\n", name);
+    fprintf(stderr, "       %s -c count [-s seed]\n", name);
+    fprintf(stderr, "       %s -q count [-s seed]\n", name);
+    fprintf(stderr, "       %s -k count [-z] [-w window] [-l loss%%] [-b baud] [-s seed]\n", name);
+}
+
+extern bool realIsInit;
+extern bool storage_keymap_valid;
+
+#define KEYMAP_TEST_LAYERS 8
+#define KEYMAP_TEST_SPARSE_LAYERS 16
+#define KEYMAP_PACKET_COUNT (1024 / KEYMAP_PACKET_SIZE)
+#define KEYMAP_TEST_LAYER_OFFSET 0x55
+#define KEYMAP_TEST_LAYER_KEYS (MATRIX_ROWS * MATRIX_COLS)
+#define KEYMAP_TEST_SIZE (KEYMAP_TEST_LAYER_OFFSET + KEYMAP_TEST_SPARSE_LAYERS * KEYMAP_TEST_LAYER_KEYS)
+
+/** 使用压缩格式下载 KEYMAP_TEST_SPARSE_LAYERS 层 */
+static bool keymap_test_sparse;
+static uint8_t keymap_test_layers = KEYMAP_TEST_LAYERS;
+static uint32_t keymap_image_max;
+
+/**
+ * @brief 按 keymap_storage.c 中的压缩格式编码，与上位机的实现相同
+ *
+ * @return 编码后的长度
+ */
+static uint32_t keymap_sparse_encode(uint8_t const * image, uint32_t len, uint8_t * out)
+{
+    uint32_t n = KEYMAP_TEST_LAYER_OFFSET;
+
+    memcpy(out, image, KEYMAP_TEST_LAYER_OFFSET);
+    out[0] = 0x5A;
+    for (uint32_t i = KEYMAP_TEST_LAYER_OFFSET; i < len;)
+    {
+        uint32_t run = 1;
+        while (i + run < len && image[i + run] == image[i] && run < 255)
+            run++;
+        if (run >= 3 || image[i] == 0xFF)
+        {
+            out[n++] = 0xFF;
+            out[n++] = image[i];
+            out[n++] = run;
+            i += run;
+        }
+        else
+            out[n++] = image[i++];
+    }
+    out[n++] = 0xFF;
+    out[n++] = 0;
+    out[n++] = 0;
+    return n;
+}
+
+/**
+ * @brief 模拟重启后重新读取 keymap，与两份期望的配置比较
+ *
+ * 除了逐层比较，还在随机的层状态下比较经过缓存解析的按键。
+ *
+ * @return 1 与 b 一致，0 与 a 一致，2 没有加载下载的配置，-1 加载了损坏的配置
+ */
+static int keymap_reload_check(uint8_t const * a, uint8_t const * b)
+{
+    uint8_t const * expect[2] = { a, b };
+    uint32_t state = (rand() % (1UL << keymap_test_layers)) | 1;
+    uint8_t top = 31 - __builtin_clz(state);
+
+    sim_pstorage_reboot();
+    keymap_init();
+    if (!storage_keymap_valid)
+        return 2;
+
+    for (int8_t n = 1; n >= 0; n--)
+    {
+        bool match = expect[n] != NULL;
+        for (uint8_t l = 0; l < keymap_test_layers && match; l++)
+            for (uint8_t r = 0; r < MATRIX_ROWS && match; r++)
+                for (uint8_t c = 0; c < MATRIX_COLS && match; c++)
+                    match = keymap_key_to_keycode(l, (keypos_t){ .row = r, .col = c }) ==
+                            expect[n][KEYMAP_TEST_LAYER_OFFSET + (l * MATRIX_ROWS + r) * MATRIX_COLS + c];
+
+        layer_state = state;
+        for (uint8_t k = 0; k < KEYMAP_TEST_LAYER_KEYS && match; k++)
+        {
+            uint8_t code = KC_TRNS;
+            for (int8_t l = top; l >= 0 && code == KC_TRNS; l--)
+                if (state & (1UL << l))
+                    code = expect[n][KEYMAP_TEST_LAYER_OFFSET + l * KEYMAP_TEST_LAYER_KEYS + k];
+            match = keymap_key_to_keycode(top, (keypos_t){ .row = k / MATRIX_COLS, .col = k % MATRIX_COLS }) == code;
+        }
+        layer_state = 0;
+        if (match)
+            return n;
+    }
+    return -1;
+}
+
+/*
+ * 下载链路的时间模型：上位机 → USB（1ms 帧）→ CH554 → UART → nRF，应答原路返回。
+ * UART 默认为连接建立时的 57600，-b 指定协商后的波特率。
+ * CH554 把包放入发送缓冲区，串口是瓶颈；应答经 CH554 转发后上位机在下一帧读到。包和应答都可能按 keymap_link_loss% 的概率损坏。
+ * flash 写入的耗时不计入（模拟的 pstorage 同步完成）。
+ */
+#define LINK_BYTE_US (10 * 1000000.0 / keymap_link_baud)
+#define LINK_FRAME_US 1000.0
+#define LINK_TIMEOUT_US 500000.0
+#define LINK_KEYMAP_BYTES 65    /**< Len Type ID DATA[60] CRC[2] */
+#define LINK_ACK_BYTES 10       /**< Len Type SESSION[2] RECEIVED[4] CRC[2] */
+#define LINK_DEVICE_WINDOW 6
+
+/** 同时发出的包数，1 为逐包应答 */
+static uint8_t keymap_window = 1;
+static uint32_t keymap_link_loss;
+static uint32_t keymap_link_baud = 57600;
+static double link_time, link_serial_free, link_total;
+static uint32_t link_downloads, link_sent;
+
+typedef struct
+{
+    double time;        /**< 应答到达上位机的时间，负数表示应答丢失 */
+    uint16_t session;
+    uint32_t received;
+} link_response_t;
+
+static link_response_t link_pending[KEYMAP_PACKET_COUNT + 1];
+static uint8_t link_pending_count;
+
+static double link_frame(double t)
+{
+    return ceil(t / LINK_FRAME_US) * LINK_FRAME_US;
+}
+
+/**
+ * @brief 经过链路发送一个包，nRF 按到达顺序处理并应答
+ */
+static void link_send(uint8_t id, uint8_t const * data)
+{
+    link_response_t * resp = &link_pending[link_pending_count++];
+    double arrive = MAX(link_frame(link_time), link_serial_free) + LINK_KEYMAP_BYTES * LINK_BYTE_US;
+
+    link_serial_free = arrive;
+    link_sent++;
+    if (rand() % 100 >= keymap_link_loss)
+    {
+        if (id == 0xFF)
+            keymap_download_begin(data[0] | data[1] << 8);
+        else
+            keymap_download(id, data);
+    }
+    resp->received = keymap_download_status(&resp->session);
+    resp->time = link_frame(arrive + LINK_ACK_BYTES * LINK_BYTE_US + LINK_FRAME_US);
+    if (rand() % 100 < keymap_link_loss)
+        resp->time = -1;
+}
+
+/**
+ * @brief 上位机读取下一个应答
+ *
+ * @return 是否读到，false 表示超时
+ */
+static bool link_read(link_response_t * out)
+{
+    for (uint8_t i = 0; i < link_pending_count; i++)
+    {
+        if (link_pending[i].time >= 0)
+        {
+            *out = link_pending[i];
+            link_time = MAX(link_time, out->time);
+            link_pending_count -= i + 1;
+            memmove(link_pending, &link_pending[i + 1], link_pending_count * sizeof(link_pending[0]));
+            return true;
+        }
+    }
+    link_pending_count = 0;
+    link_time += LINK_TIMEOUT_US;
+    return false;
+}
+
+/**
+ * @brief 按上位机（KeymapDownloader）的方式下发配置
+ *
+ * 先开始下载，然后保持 keymap_window 个包在途中，根据应答中的已接收列表重发缺少的包。
+ *
+ * @param packets 发送 packets 个包后停止，模拟中途断开；不少于 KEYMAP_PACKET_COUNT 时发送到完成为止
+ */
+static void keymap_send(uint8_t const * image, uint8_t packets)
+{
+    static uint8_t buf[KEYMAP_PACKET_COUNT * KEYMAP_PACKET_SIZE];
+    static uint16_t session;
+    uint32_t len = sizeof(buf), acked = 0, all = (1UL << KEYMAP_PACKET_COUNT) - 1;
+    uint32_t sent = 0, limit = packets < KEYMAP_PACKET_COUNT ? packets : UINT32_MAX;
+    uint8_t inflight[KEYMAP_PACKET_COUNT], inflight_count = 0;
+    uint8_t begin[KEYMAP_PACKET_SIZE] = { 0 };
+    link_response_t resp;
+
+    memset(buf, 0, sizeof(buf));
+    if (keymap_test_sparse)
+        len = keymap_sparse_encode(image, KEYMAP_TEST_SIZE, buf);
+    else
+        memcpy(buf, image, sizeof(buf));
+    keymap_image_max = MAX(keymap_image_max, len);
+
+    link_time = link_serial_free = 0;
+    link_pending_count = 0;
+    session = session % 0xFFFF + 1;
+    begin[0] = session;
+    begin[1] = session >> 8;
+    do
+    {
+        link_send(0xFF, begin);
+    } while (!link_read(&resp) || resp.session != session);
+
+    while (acked != all && sent < limit)
+    {
+        uint8_t first = 0;
+        while (acked & (1UL << first))
+            first++;
+        for (uint8_t id = first; id < KEYMAP_PACKET_COUNT && id < first + LINK_DEVICE_WINDOW &&
+                                 inflight_count < keymap_window && sent < limit; id++)
+        {
+            bool busy = acked & (1UL << id);
+            for (uint8_t i = 0; i < inflight_count; i++)
+                busy |= inflight[i] == id;
+            if (!busy)
+            {
+                link_send(id, &buf[id * KEYMAP_PACKET_SIZE]);
+                inflight[inflight_count++] = id;
+                sent++;
+            }
+        }
+
+        if (link_read(&resp))
+        {
+            if (resp.session == session)
+                acked = resp.received;
+            memmove(inflight, &inflight[1], --inflight_count);
+        }
+        else
+            inflight_count = 0;
+    }
+
+    if (acked == all)
+    {
+        link_total += link_time;
+        link_downloads++;
+    }
+}
+
+/**
+ * @brief 随机生成一个按键
+ *
+ * 压缩格式的测试中除第 0 层外大部分按键为 KC_TRNS
+ */
+static uint8_t keymap_random_code(uint8_t layer)
+{
+    if (keymap_test_sparse && layer && rand() % 16)
+        return KC_TRNS;
+    return rand() % 0xE8;
+}
+
+/**
+ * @brief 模拟反复下载 keymap：每次修改某一层的几个按键后下载，检查重启后读回的配置。
+ * 其中一部分下载中途断开或写入过程中掉电，此时读回的必须是修改前或修改后的配置，或者不加载。
+ */
+static int keymap_test(uint32_t count, uint32_t seed)
+{
+    static uint8_t expect[MAX(KEYMAP_TEST_SIZE, KEYMAP_PACKET_COUNT * KEYMAP_PACKET_SIZE)], prev[sizeof(expect)];
+    uint32_t mismatch = 0, torn = 0, torn_detected = 0, torn_garbage = 0, erase = 0, words = 0;
+
+    if (keymap_test_sparse)
+        keymap_test_layers = KEYMAP_TEST_SPARSE_LAYERS;
+
+    srand(seed);
+    memset(expect, 0, sizeof(expect));
+    expect[0] = 0x55;
+    for (uint8_t l = 0; l < keymap_test_layers; l++)
+        for (uint16_t k = 0; k < KEYMAP_TEST_LAYER_KEYS; k++)
+            expect[KEYMAP_TEST_LAYER_OFFSET + l * KEYMAP_TEST_LAYER_KEYS + k] = keymap_random_code(l);
+    keymap_send(expect, KEYMAP_PACKET_COUNT);
+    memset(&sim_flash_stats, 0, sizeof(sim_flash_stats));
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        memcpy(prev, expect, sizeof(expect));
+        uint8_t layer = 1 + rand() % (keymap_test_layers - 1);
+        // 有时重新下载的配置没有变化
+        for (uint8_t k = rand() % 5; k; k--)
+            expect[KEYMAP_TEST_LAYER_OFFSET + layer * KEYMAP_TEST_LAYER_KEYS + rand() % KEYMAP_TEST_LAYER_KEYS] = keymap_random_code(layer);
+
+        uint8_t packets = KEYMAP_PACKET_COUNT;
+        bool cut = rand() % 8 == 0;
+        if (cut)
+        {
+            if (rand() % 2)
+                sim_pstorage_power_cut(rand() % 300);
+            else
+                packets = rand() % KEYMAP_PACKET_COUNT;
+        }
+        keymap_send(expect, packets);
+
+        int result = keymap_reload_check(prev, expect);
+        if (cut)
+        {
+            torn++;
+            if (result == 2)
+                torn_detected++;
+            if (result < 0)
+                torn_garbage++;
+            if (result != 1)
+            {
+                // 重新下载一次
+                keymap_send(expect, KEYMAP_PACKET_COUNT);
+                result = keymap_reload_check(NULL, expect);
+            }
+        }
+        if (result != 1)
+            mismatch++;
+    }
+    erase = sim_flash_stats.page_erase;
+    words = sim_flash_stats.word_write;
+
+    printf("keymap_downloads=%u\n", count);
+    printf("keymap_layers=%u\n", keymap_test_layers);
+    printf("keymap_image_max=%u\n", keymap_image_max);
+    printf("keymap_window=%u\n", keymap_window);
+    printf("keymap_link_loss=%u%%\n", keymap_link_loss);
+    printf("keymap_link_baud=%u\n", keymap_link_baud);
+    printf("keymap_packets_sent=%u\n", link_sent);
+    printf("keymap_download_ms=%.1f\n", link_total / link_downloads / 1000);
+    printf("keymap_mismatch=%u\n", mismatch);
+    printf("keymap_interrupted=%u\n", torn);
+    printf("keymap_interrupted_detected=%u\n", torn_detected);
+    printf("keymap_interrupted_garbage=%u\n", torn_garbage);
+    printf("flash_erase=%u\n", erase);
+    printf("flash_word_write=%u\n", words);
+    printf("flash_busy_ms=%.1f\n", (erase * SIM_FLASH_PAGE_ERASE_US + words * SIM_FLASH_WORD_WRITE_US) / 1000.0);
+    return mismatch ? 1 : 0;
+}
+
+/**
+ * @brief 模拟重启后重新读取 eeconfig
+ */
+static void eeconfig_reboot(void)
+{
+    // 重启后按注册顺序重新读取
+    sim_pstorage_reboot();
+    keymap_init();
+    realIsInit = false;
+    eeconfig_init();
+}
+
+/**
+ * @brief 随机修改 eeconfig，模拟重启后检查读回的配置，并统计 flash 操作
+ *
+ * 有时恢复默认配置（重写快照），其中一半在写入过程中掉电：重启后只能是原来的配置或默认配置，
+ * 不在默认配置中的蓝牙主机不能丢失。
+ */
+static int eeconfig_test(uint32_t count, uint32_t seed)
+{
+    uint8_t expect[3] = { eeconfig_read_debug(), eeconfig_read_default_layer(), eeconfig_read_keymap() };
+    uint8_t host = 2;
+    uint32_t mismatch = 0, resets = 0, host_lost = 0;
+
+    eeconfig_write_ble_host(host);
+    memset(&sim_flash_stats, 0, sizeof(sim_flash_stats));
+    srand(seed);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (rand() % 32 == 0)
+        {
+            if (rand() % 2)
+                sim_pstorage_power_cut(rand() % 5);
+            eeconfig_init();
+            eeconfig_reboot();
+            resets++;
+
+            uint8_t now[3] = { eeconfig_read_debug(), eeconfig_read_default_layer(), eeconfig_read_keymap() };
+            uint8_t zero[3] = { 0 };
+            if (eeconfig_read_ble_host() != host)
+                host_lost++;
+            if (memcmp(now, expect, sizeof(now)) && memcmp(now, zero, sizeof(now)))
+                mismatch++;
+            memcpy(expect, now, sizeof(expect));
+            continue;
+        }
+
+        uint8_t item = rand() % 3, val = rand() % 4;
+        expect[item] = val;
+        if (item == 0)
+            eeconfig_write_debug(val);
+        else if (item == 1)
+            eeconfig_write_default_layer(val);
+        else
+            eeconfig_write_keymap(val);
+
+        if (rand() % 64 == 0 || i == count - 1)
+        {
+            eeconfig_reboot();
+            if (eeconfig_read_debug() != expect[0] || eeconfig_read_default_layer() != expect[1] ||
+                eeconfig_read_keymap() != expect[2])
+                mismatch++;
+        }
+    }
+
+    printf("eeconfig_writes=%u\n", count);
+    printf("eeconfig_mismatch=%u\n", mismatch);
+    printf("eeconfig_resets=%u\n", resets);
+    printf("eeconfig_host_lost=%u\n", host_lost);
+    printf("flash_erase=%u\n", sim_flash_stats.page_erase);
+    printf("flash_word_write=%u\n", sim_flash_stats.word_write);
+    printf("flash_busy_ms=%.1f\n", (sim_flash_stats.page_erase * SIM_FLASH_PAGE_ERASE_US +
+                                     sim_flash_stats.word_write * SIM_FLASH_WORD_WRITE_US) / 1000.0);
+    return mismatch || host_lost ? 1 : 0;
+}
+
+/*
+ * UART 帧的错误注入：随机生成数据长度 1~61 的包，分别附加原来的 8 位累加校验和现在的 CRC-16，
+ * 按同样的方式破坏数据部分，统计两种校验没有发现的错误。
+ * 同时检查 CH554 的查表 CRC（usb/crc.c）与 nRF 使用的 crc16_compute 结果一致，
+ * 并统计每个包校验耗费的主机 CPU 周期。
+ */
+#define FRAME_DATA_MAX 61
+
+typedef enum
+{
+    FRAME_ERROR_BIT1,      /**< 翻转 1 位 */
+    FRAME_ERROR_BIT2,      /**< 翻转 2 位 */
+    FRAME_ERROR_SWAP,      /**< 交换相邻的两个不同字节 */
+    FRAME_ERROR_BURST,     /**< 连续 2~4 个字节变为随机值 */
+    FRAME_ERROR_COUNT
+} frame_error_t;
+
+static const char * const frame_error_name[FRAME_ERROR_COUNT] = { "bit1", "bit2", "swap", "burst" };
+
+static uint8_t frame_sum(uint8_t const * data, uint8_t len)
+{
+    uint8_t sum = 0;
+    while (len--)
+        sum += *(data++);
+    return sum;
+}
+
+/**
+ * @brief 破坏 data 的内容，多次尝试都没有改变（例如相邻字节相同）时保持原样
+ */
+static void frame_corrupt(uint8_t * data, uint8_t len, frame_error_t type)
+{
+    uint8_t origin[FRAME_DATA_MAX];
+    uint8_t pos, retry = 16;
+
+    memcpy(origin, data, len);
+    do
+    {
+        memcpy(data, origin, len);
+        switch (type)
+        {
+        case FRAME_ERROR_BIT1:
+            data[rand() % len] ^= 1 << (rand() % 8);
+            break;
+        case FRAME_ERROR_BIT2:
+            data[rand() % len] ^= 1 << (rand() % 8);
+            data[rand() % len] ^= 1 << (rand() % 8);
+            break;
+        case FRAME_ERROR_SWAP:
+            if (len < 2)
+                return;
+            pos = rand() % (len - 1);
+            data[pos] = origin[pos + 1];
+            data[pos + 1] = origin[pos];
+            break;
+        default:
+            pos = rand() % len;
+            for (uint8_t i = 2 + rand() % 3; i && pos < len; i--)
+                data[pos++] = rand();
+            break;
+        }
+    } while (memcmp(data, origin, len) == 0 && --retry);
+}
+
+static int frame_test(uint32_t count, uint32_t seed)
+{
+    uint8_t frame[1 + FRAME_DATA_MAX], corrupt[1 + FRAME_DATA_MAX];
+    uint32_t tested[FRAME_ERROR_COUNT] = { 0 };
+    uint32_t sum_missed[FRAME_ERROR_COUNT] = { 0 }, crc_missed[FRAME_ERROR_COUNT] = { 0 };
+    uint32_t mismatch = 0, bytes = 0;
+    uint64_t sum_cycles = 0, crc_cycles = 0, table_cycles = 0, start;
+    volatile uint16_t sink;
+
+    srand(seed);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint8_t len = 1 + rand() % FRAME_DATA_MAX;
+        frame_error_t type = (frame_error_t)(i % FRAME_ERROR_COUNT);
+
+        // frame[0] 为类型，CRC 包括类型，累加校验只包括数据
+        for (uint8_t j = 0; j <= len; j++)
+            frame[j] = rand();
+        bytes += len + 1;
+
+        start = cycles_now();
+        sink = frame_sum(&frame[1], len);
+        sum_cycles += cycles_now() - start;
+
+        start = cycles_now();
+        uint16_t crc = crc16_compute(frame, len + 1, NULL);
+        crc_cycles += cycles_now() - start;
+
+        start = cycles_now();
+        sink = crc16(0xFFFF, frame, len + 1);
+        table_cycles += cycles_now() - start;
+        if (sink != crc)
+            mismatch++;
+
+        // 接收方的检查方式：附加高字节在前的 CRC 后，整个包的 CRC 为 0
+        uint8_t crc_bytes[2] = { crc >> 8, crc & 0xFF };
+        uint16_t check;
+
+        memcpy(corrupt, frame, len + 1);
+        frame_corrupt(&corrupt[1], len, type);
+        if (memcmp(corrupt, frame, len + 1) == 0)
+            continue;
+        tested[type]++;
+        if (frame_sum(&corrupt[1], len) == frame_sum(&frame[1], len))
+            sum_missed[type]++;
+        check = crc16_compute(corrupt, len + 1, NULL);
+        check = crc16_compute(crc_bytes, 2, &check);
+        if (check == 0)
+            crc_missed[type]++;
+    }
+    (void)sink;
+
+    printf("frames=%u\n", count);
+    printf("frame_avg_bytes=%.1f\n", (double)bytes / count);
+    for (uint8_t t = 0; t < FRAME_ERROR_COUNT; t++)
+    {
+        printf("%s_tested=%u\n", frame_error_name[t], tested[t]);
+        printf("%s_sum_undetected=%.4f%%\n", frame_error_name[t], tested[t] ? 100.0 * sum_missed[t] / tested[t] : 0);
+        printf("%s_crc_undetected=%.4f%%\n", frame_error_name[t], tested[t] ? 100.0 * crc_missed[t] / tested[t] : 0);
+    }
+    printf("sum_cycles_per_frame=%.1f\n", (double)sum_cycles / count);
+    printf("crc16_compute_cycles_per_frame=%.1f\n", (double)crc_cycles / count);
+    printf("crc16_table_cycles_per_frame=%.1f\n", (double)table_cycles / count);
+    printf("crc_table_mismatch=%u\n", mismatch);
+    return mismatch ? 1 : 0;
+}
+
+/**
+ * 报告队列测试
+ *
+ * 用 report_queue.c 发送随机的键盘、System 和 Consumer 报告，模拟的协议栈有 QUEUE_TX_BUFFERS 个发送缓冲区，
+ * 每个连接事件按到达顺序发出若干个包，部分连接事件因干扰没有发出任何包，缓冲区经常耗尽。
+ * 主机收到的每种报告必须是发出的报告按顺序去掉一部分中间状态，最后收到的必须是最终状态。
+ * 延迟为报告提交到主机收到它或更新的状态的时间。
+ *
+ * 同样的输入再按每个发送完成事件只发出一个排队报告的方式运行一次作为对比。
+ */
+#define QUEUE_TX_BUFFERS 7            /**< S110 的 sd_ble_tx_buffer_count_get() */
+#define QUEUE_CONN_INTERVAL_US 20000  /**< 与 ble_services.c 的 MIN_CONN_INTERVAL 相同 */
+#define QUEUE_EVENT_PACKETS 3         /**< 每个连接事件最多发出的包数 */
+#define QUEUE_MISS_PERCENT 30         /**< 没有发出任何包的连接事件的比例 */
+#define QUEUE_DUPLICATE_PERCENT 10    /**< 重复提交相同报告的比例 */
+
+typedef struct
+{
+    uint32_t time;
+    uint8_t data[REPORT_SLOT_SIZE];
+} queue_submit_t;
+
+typedef struct
+{
+    uint8_t id;
+    uint8_t data[REPORT_SLOT_SIZE];
+} queue_packet_t;
+
+static uint8_t const queue_report_len[REPORT_QUEUE_IDS] = { 8, 2, 2 };
+static queue_submit_t * queue_submit[REPORT_QUEUE_IDS];
+static uint32_t queue_submit_count[REPORT_QUEUE_IDS];
+static uint32_t queue_received[REPORT_QUEUE_IDS];  /**< 主机收到的最后一个报告在 queue_submit 中的位置 + 1 */
+static queue_packet_t queue_link[QUEUE_TX_BUFFERS];
+static uint8_t queue_link_count;
+static uint32_t * queue_latency;
+static uint32_t queue_latency_count, queue_order_errors;
+
+static bool queue_link_send(uint8_t id, uint8_t * p_data)
+{
+    if (queue_link_count >= QUEUE_TX_BUFFERS)
+        return false;
+    queue_link[queue_link_count].id = id;
+    memcpy(queue_link[queue_link_count].data, p_data, queue_report_len[id]);
+    queue_link_count++;
+    return true;
+}
+
+/**
+ * @brief 主机收到报告，在提交的报告中向后查找相同的报告
+ */
+static void queue_host_receive(queue_packet_t const * packet, uint32_t now)
+{
+    uint8_t id = packet->id;
+    uint32_t i;
+
+    for (i = queue_received[id]; i < queue_submit_count[id]; i++)
+    {
+        if (memcmp(queue_submit[id][i].data, packet->data, queue_report_len[id]) == 0)
+            break;
+    }
+    if (i == queue_submit_count[id])
+    {
+        queue_order_errors++;
+        return;
+    }
+    for (; queue_received[id] <= i; queue_received[id]++)
+        queue_latency[queue_latency_count++] = now - queue_submit[id][queue_received[id]].time;
+}
+
+/**
+ * @brief 一个连接事件
+ *
+ * @param drain_one 按每个发送完成事件只发出一个排队报告的方式处理
+ */
+static void queue_conn_event(uint32_t now, bool drain_one)
+{
+    uint8_t sent = 0;
+
+    if (rand() % 100 >= QUEUE_MISS_PERCENT)
+        sent = 1 + rand() % QUEUE_EVENT_PACKETS;
+    sent = MIN(sent, queue_link_count);
+    for (uint8_t i = 0; i < sent; i++)
+        queue_host_receive(&queue_link[i], now);
+    queue_link_count -= sent;
+    memmove(queue_link, &queue_link[sent], queue_link_count * sizeof(queue_link[0]));
+    if (sent)
+        report_queue_tx_complete(drain_one ? 1 : sent);
+}
+
+/**
+ * @brief 生成随机的报告序列，按时间顺序交替分配到各种报告
+ *
+ * @return 每个报告所属的种类
+ */
+static uint8_t * queue_generate(uint32_t count)
+{
+    uint8_t * order = malloc(count);
+    uint8_t keys[6] = { 0 }, held = 0;
+    uint8_t usage[REPORT_QUEUE_IDS][2] = { { 0 } };
+    uint32_t time = 0;
+
+    for (uint8_t id = 0; id < REPORT_QUEUE_IDS; id++)
+    {
+        queue_submit[id] = malloc(count * sizeof(queue_submit_t));
+        queue_submit_count[id] = 0;
+    }
+    for (uint32_t n = 0; n < count; n++)
+    {
+        // 30% 为连续按键，其余的间隔平均 40ms
+        if (rand() % 100 < 30)
+            time += rand() % 5000;
+        else
+            time += (uint32_t)(-log((rand() + 1.0) / ((double)RAND_MAX + 2)) * 40000);
+
+        uint8_t id = rand() % 100 < 80 ? 0 : 1 + rand() % 2;
+        queue_submit_t * sub = &queue_submit[id][queue_submit_count[id]];
+        bool repeat = queue_submit_count[id] && rand() % 100 < QUEUE_DUPLICATE_PERCENT;
+
+        if (!repeat && id == 0)
+        {
+            if (held < 6 && (held == 0 || rand() % 2))
+                keys[held++] = KC_A + rand() % (KC_Z - KC_A + 1);
+            else
+            {
+                uint8_t k = rand() % held;
+                keys[k] = keys[--held];
+            }
+        }
+        else if (!repeat)
+        {
+            usage[id][0] = usage[id][0] ? 0 : 1 + rand() % 0xFF;
+        }
+
+        memset(sub->data, 0, sizeof(sub->data));
+        if (repeat)
+            memcpy(sub->data, queue_submit[id][queue_submit_count[id] - 1].data, queue_report_len[id]);
+        else if (id == 0)
+            memcpy(&sub->data[2], keys, held);
+        else
+            memcpy(sub->data, usage[id], 2);
+        sub->time = time;
+        queue_submit_count[id]++;
+        order[n] = id;
+    }
+    return order;
+}
+
+static int queue_run(char const * name, uint8_t const * order, uint32_t count, bool drain_one, uint32_t seed)
+{
+    uint32_t next[REPORT_QUEUE_IDS] = { 0 };
+    uint32_t now = 0, event = QUEUE_CONN_INTERVAL_US, final_mismatch = 0;
+    uint64_t sum = 0;
+
+    srand(seed);
+    queue_latency_count = queue_order_errors = 0;
+    queue_link_count = 0;
+    memset(queue_received, 0, sizeof(queue_received));
+    memset(&report_queue_stats, 0, sizeof(report_queue_stats));
+    report_queue_init(queue_link_send, queue_report_len);
+    report_queue_tx_buffers(QUEUE_TX_BUFFERS);
+
+    for (uint32_t n = 0; n < count; n++)
+    {
+        queue_submit_t * sub = &queue_submit[order[n]][next[order[n]]++];
+
+        for (; event <= sub->time; event += QUEUE_CONN_INTERVAL_US)
+            queue_conn_event(event, drain_one);
+        now = sub->time;
+        report_queue_submit(order[n], sub->data);
+    }
+    // 停止输入后继续运行，直到队列和缓冲区都清空
+    for (; queue_link_count || report_queue_pending(); event += QUEUE_CONN_INTERVAL_US)
+        queue_conn_event(event, drain_one);
+
+    for (uint8_t id = 0; id < REPORT_QUEUE_IDS; id++)
+    {
+        if (queue_received[id] != queue_submit_count[id])
+            final_mismatch++;
+    }
+
+    printf("%s_order_errors=%u\n", name, queue_order_errors);
+    printf("%s_final_mismatch=%u\n", name, final_mismatch);
+    printf("%s_queued=%u\n", name, report_queue_stats.queued);
+    printf("%s_coalesced=%u\n", name, report_queue_stats.coalesced);
+    printf("%s_dropped=%u\n", name, report_queue_stats.dropped);
+    if (queue_latency_count)
+    {
+        qsort(queue_latency, queue_latency_count, sizeof(queue_latency[0]), latency_cmp);
+        for (uint32_t i = 0; i < queue_latency_count; i++)
+            sum += queue_latency[i];
+        printf("%s_latency_ms_avg=%.1f\n", name, (double)sum / 1000 / queue_latency_count);
+        printf("%s_latency_ms_p99=%.1f\n", name, (double)queue_latency[queue_latency_count * 99 / 100] / 1000);
+        printf("%s_latency_ms_max=%.1f\n", name, (double)queue_latency[queue_latency_count - 1] / 1000);
+    }
+    printf("%s_drain_ms=%.1f\n", name, (double)(event - now) / 1000);
+    return queue_order_errors || final_mismatch;
+}
+
+static int queue_test(uint32_t count, uint32_t seed)
+{
+    uint8_t * order;
+    int err;
+
+    srand(seed);
+    order = queue_generate(count);
+    queue_latency = malloc(count * sizeof(uint32_t));
+
+    printf("reports=%u\n", count);
+    printf("tx_buffers=%u\n", QUEUE_TX_BUFFERS);
+    err = queue_run("drain_all", order, count, false, seed);
+    // 只用于对比，逐个发出时没有顺序错误，只是更慢
+    err |= queue_run("drain_one", order, count, true, seed);
+    return err;
+}
+
+int main(int argc, char * argv[])
+{
+    uint32_t random_count = 0, eeconfig_count = 0, keymap_count = 0, frame_count = 0, queue_count = 0, seed = 1, pos = 0, end;
+    const char * trace_path = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else if (strcmp(argv[i], "-p") == 0)
+            radio_trace = true;
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            random_count = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            sim_gpio_set_settle(strtoul(argv[++i], NULL, 0));
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+            eeconfig_count = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            frame_count = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+            queue_count = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+            keymap_count = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-z") == 0)
+            keymap_test_sparse = true;
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            keymap_window = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            keymap_link_loss = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            keymap_link_baud = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            seed = strtoul(argv[++i], NULL, 0);
+        else if (argv[i][0] != '-' && trace_path == NULL)
+            trace_path = argv[i];
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (frame_count)
+        return frame_test(frame_count, seed);
+    if (queue_count)
+        return queue_test(queue_count, seed);
+
+    sim_gpio_init();
+    keyboard_scan_init();
+    keyboard_setup();
+    led_init();
+    pstorage_init();
+    keymap_init();
+    keyboard_init();
+    host_set_driver(&driver);
+
+    if (eeconfig_count)
+        return eeconfig_test(eeconfig_count, seed);
+    if (keymap_count)
+        return keymap_test(keymap_count, seed);
+    if (trace_path && !trace_load(trace_path))
+        return 1;
+    if (random_count)
+        trace_random(random_count, seed);
+    if (trace_len == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // 初始化阶段的开销不计入统计
+    scan_cycles = scan_count = scan_gpio = 0;
+    task_cycles = task_count = modified_count = phantom_count = 0;
+    memset(&sim_flash_stats, 0, sizeof(sim_flash_stats));
+    sim_keyboard_reports = sim_extra_reports = 0;
+
+    keyboard_scan_start();
+
+    end = trace[trace_len - 1].tick + IDLE_TAIL_SCANS;
+    for (scan_tick = 0; scan_tick <= end; scan_tick++)
+    {
+        sim_timer_advance(SCAN_TICKS / 2);
+        app_sched_execute();
+        trace_apply(&pos);
+        app_sched_execute();
+        sim_timer_advance(SCAN_TICKS - SCAN_TICKS / 2);
+        app_sched_execute();
+    }
+
+    if (trace_path)
+        printf("trace=%s\n", trace_path);
+    else
+        printf("trace=random:%u:%u\n", random_count, seed);
+    report_print();
+    if (radio_trace)
+        sim_radio_print(verbose);
+    return 0;
+}
@@ -0,0 +1,229 @@
+/**
+ * @brief 模拟 pstorage
+ *
+ * flash 按 NOR 特性建模：写入只能把 1 变成 0，擦除以页为单位。
+ * 所有操作都同步完成并立即调用模块回调，同时统计擦除和写入次数，
+ * 用于估计各存储方案在真机上占用 flash 的时间。
+ *
+ * @file sim_pstorage.c
+ */
+#include <string.h>
+#include "pstorage.h"
+#include "nrf_error.h"
+#include "sim.h"
+
+#define MAX_MODULES PSTORAGE_NUM_OF_PAGES
+
+typedef struct
+{
+    pstorage_ntf_cb_t cb;
+    pstorage_size_t block_size;
+    pstorage_size_t block_count;
+    uint32_t base;
+} sim_module_t;
+
+sim_flash_stats_t sim_flash_stats;
+
+static uint8_t flash[PSTORAGE_NUM_OF_PAGES * PSTORAGE_FLASH_PAGE_SIZE] __attribute__((aligned(4)));
+static sim_module_t modules[MAX_MODULES];
+static uint8_t module_count;
+static uint32_t next_page;
+/** 掉电前还能写入的字数，负数表示不掉电 */
+static int32_t power_words = -1;
+
+static void flash_erase_page(uint32_t page)
+{
+    if (power_words == 0)
+        return;
+    memset(&flash[page * PSTORAGE_FLASH_PAGE_SIZE], 0xFF, PSTORAGE_FLASH_PAGE_SIZE);
+    sim_flash_stats.page_erase++;
+}
+
+static void flash_write(uint32_t addr, uint8_t const * data, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+    {
+        if (i % 4 == 0 && power_words >= 0)
+        {
+            if (power_words == 0)
+                break;
+            power_words--;
+        }
+        flash[addr + i] &= data[i];
+    }
+    sim_flash_stats.word_write += (len + 3) / 4;
+}
+
+static sim_module_t * module_get(pstorage_handle_t * p_handle)
+{
+    if (p_handle == NULL || p_handle->module_id >= module_count)
+        return NULL;
+    return &modules[p_handle->module_id];
+}
+
+static uint32_t range_check(pstorage_handle_t * p_handle, pstorage_size_t size, pstorage_size_t offset)
+{
+    sim_module_t * module = module_get(p_handle);
+    if (module == NULL)
+        return NRF_ERROR_INVALID_PARAM;
+    if (size == 0 || p_handle->block_id < module->base ||
+        p_handle->block_id + offset + size > module->base + (uint32_t)module->block_size * module->block_count)
+        return NRF_ERROR_INVALID_PARAM;
+    return NRF_SUCCESS;
+}
+
+uint32_t pstorage_init(void)
+{
+    memset(flash, 0xFF, sizeof(flash));
+    memset(modules, 0, sizeof(modules));
+    module_count = 0;
+    next_page = 0;
+    return NRF_SUCCESS;
+}
+
+uint8_t const * sim_pstorage_address(pstorage_block_t block_id)
+{
+    return &flash[block_id];
+}
+
+/**
+ * @brief 模拟重启：保留 flash 内容，清除模块注册
+ */
+void sim_pstorage_reboot(void)
+{
+    memset(modules, 0, sizeof(modules));
+    module_count = 0;
+    next_page = 0;
+    power_words = -1;
+}
+
+/**
+ * @brief 模拟掉电：再写入 words 个字后，之后的擦除和写入都不再生效，直到 sim_pstorage_reboot()
+ */
+void sim_pstorage_power_cut(uint32_t words)
+{
+    power_words = words;
+}
+
+uint32_t pstorage_register(pstorage_module_param_t * p_module_param, pstorage_handle_t * p_block_id)
+{
+    uint32_t size = (uint32_t)p_module_param->block_size * p_module_param->block_count;
+    uint32_t pages = (size + PSTORAGE_FLASH_PAGE_SIZE - 1) / PSTORAGE_FLASH_PAGE_SIZE;
+
+    if (p_module_param->cb == NULL || size == 0 || p_module_param->block_size < PSTORAGE_MIN_BLOCK_SIZE)
+        return NRF_ERROR_INVALID_PARAM;
+    if (module_count >= MAX_MODULES || next_page + pages > PSTORAGE_NUM_OF_PAGES)
+        return NRF_ERROR_NO_MEM;
+
+    modules[module_count].cb = p_module_param->cb;
+    modules[module_count].block_size = p_module_param->block_size;
+    modules[module_count].block_count = p_module_param->block_count;
+    modules[module_count].base = next_page * PSTORAGE_FLASH_PAGE_SIZE;
+
+    p_block_id->module_id = module_count;
+    p_block_id->block_id = modules[module_count].base;
+
+    module_count++;
+    next_page += pages;
+    return NRF_SUCCESS;
+}
+
+uint32_t pstorage_block_identifier_get(pstorage_handle_t * p_base_id, pstorage_size_t block_num, pstorage_handle_t * p_block_id)
+{
+    sim_module_t * module = module_get(p_base_id);
+    if (module == NULL || block_num >= module->block_count)
+        return NRF_ERROR_INVALID_PARAM;
+
+    p_block_id->module_id = p_base_id->module_id;
+    p_block_id->block_id = p_base_id->block_id + (uint32_t)block_num * module->block_size;
+    return NRF_SUCCESS;
+}
+
+uint32_t pstorage_store(pstorage_handle_t * p_dest, uint8_t * p_src, pstorage_size_t size, pstorage_size_t offset)
+{
+    uint32_t err_code = range_check(p_dest, size, offset);
+    if (err_code != NRF_SUCCESS)
+        return err_code;
+
+    flash_write(p_dest->block_id + offset, p_src, size);
+    module_get(p_dest)->cb(p_dest, PSTORAGE_STORE_OP_CODE, NRF_SUCCESS, p_src, size);
+    return NRF_SUCCESS;
+}
+
+/**
+ * @brief 更新数据
+ *
+ * SDK 的实现会先把整页搬到交换页，再擦除原页并写回，这里按同样的代价计数。
+ */
+uint32_t pstorage_update(pstorage_handle_t * p_dest, uint8_t * p_src, pstorage_size_t size, pstorage_size_t offset)
+{
+    uint32_t err_code = range_check(p_dest, size, offset);
+    if (err_code != NRF_SUCCESS)
+        return err_code;
+
+    uint32_t addr = p_dest->block_id + offset;
+    uint32_t page = addr / PSTORAGE_FLASH_PAGE_SIZE;
+    uint8_t backup[PSTORAGE_FLASH_PAGE_SIZE];
+
+    memcpy(backup, &flash[page * PSTORAGE_FLASH_PAGE_SIZE], sizeof(backup));
+    memcpy(&backup[addr % PSTORAGE_FLASH_PAGE_SIZE], p_src, size);
+
+    // 交换页擦写一次，原页擦写一次
+    flash_erase_page(page);
+    sim_flash_stats.page_erase++;
+    sim_flash_stats.word_write += PSTORAGE_FLASH_PAGE_SIZE / 4;
+    flash_write(page * PSTORAGE_FLASH_PAGE_SIZE, backup, sizeof(backup));
+
+    module_get(p_dest)->cb(p_dest, PSTORAGE_UPDATE_OP_CODE, NRF_SUCCESS, p_src, size);
+    return NRF_SUCCESS;
+}
+
+uint32_t pstorage_load(uint8_t * p_dest, pstorage_handle_t * p_src, pstorage_size_t size, pstorage_size_t offset)
+{
+    uint32_t err_code = range_check(p_src, size, offset);
+    if (err_code != NRF_SUCCESS)
+        return err_code;
+
+    memcpy(p_dest, &flash[p_src->block_id + offset], size);
+    return NRF_SUCCESS;
+}
+
+uint32_t pstorage_clear(pstorage_handle_t * p_base_id, pstorage_size_t size)
+{
+    uint32_t err_code = range_check(p_base_id, size, 0);
+    if (err_code != NRF_SUCCESS)
+        return err_code;
+
+    uint32_t addr = p_base_id->block_id;
+    uint32_t page = addr / PSTORAGE_FLASH_PAGE_SIZE;
+
+    if (addr % PSTORAGE_FLASH_PAGE_SIZE == 0 && size == PSTORAGE_FLASH_PAGE_SIZE)
+    {
+        flash_erase_page(page);
+    }
+    else
+    {
+        uint8_t backup[PSTORAGE_FLASH_PAGE_SIZE];
+        memcpy(backup, &flash[page * PSTORAGE_FLASH_PAGE_SIZE], sizeof(backup));
+        memset(&backup[addr % PSTORAGE_FLASH_PAGE_SIZE], 0xFF, size);
+
+        flash_erase_page(page);
+        sim_flash_stats.page_erase++;
+        sim_flash_stats.word_write += PSTORAGE_FLASH_PAGE_SIZE / 4;
+        flash_write(page * PSTORAGE_FLASH_PAGE_SIZE, backup, sizeof(backup));
+    }
+
+    module_get(p_base_id)->cb(p_base_id, PSTORAGE_CLEAR_OP_CODE, NRF_SUCCESS, NULL, size);
+    return NRF_SUCCESS;
+}
+
+uint32_t pstorage_access_status_get(uint32_t * p_count)
+{
+    *p_count = 0;
+    return NRF_SUCCESS;
+}
+
+void pstorage_sys_event_handler(uint32_t sys_evt)
+{
+    (void)sys_evt;
+}
@@ -0,0 +1,239 @@
+/**
+ * @brief 模拟 BLE 连接事件，估计不同连接参数策略下的射频功耗与发送延迟
+ *
+ * 回放轨迹时记录矩阵变化和发出报告的时间，结束后按以下策略分别计算：
+ *
+ *   fixed    固定使用 20~60ms、从机延迟 4、监督超时 1s 的参数（原来的做法）
+ *   profile  打字时请求低延迟参数，闲置 CONN_IDLE_TIMEOUT 后请求省电参数
+ *   local    在 profile 的基础上，闲置时使用本地连接延迟，第一次矩阵变化时立即关闭
+ *
+ * 主机总是接受请求的参数，在请求后的第 RADIO_UPDATE_EVENTS 个连接事件生效，
+ * 间隔取请求范围内的最大值。从机有数据要发送时总是在下一个连接事件醒来，
+ * 否则按（本地）从机延迟跳过连接事件。每个连接事件最多发出 RADIO_EVENT_PACKETS 个包。
+ *
+ * 轨迹中按键的时间是整数毫秒，连接事件也从 0 开始时两者的相位固定，发送延迟取决于对齐的巧合。
+ * 因此每个策略都从 RADIO_PHASES 个均匀分布的起点各计算一次，输出平均值。
+ *
+ * @file sim_radio.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "app_timer.h"
+#include "config.h"
+#include "sim.h"
+
+#define RADIO_MAX_RECORDS 65536
+#define RADIO_UPDATE_EVENTS 6
+#define RADIO_EVENT_PACKETS 3
+#define RADIO_FIRST_KEY_GAP_US 1000000   /**< 与上一个报告间隔超过这个时间的报告视为第一次按键 */
+#define RADIO_PHASES 16                  /**< 第一个连接事件的起点数，均匀分布在 RADIO_FIXED_INTERVAL_US 内 */
+
+/** 原来的连接参数 */
+#define RADIO_FIXED_INTERVAL_US 60000
+#define RADIO_FIXED_LATENCY 4
+
+/** 连接参数，与 ble_services.c 相同 */
+#define RADIO_TYPING_INTERVAL_US 15000
+#define RADIO_TYPING_LATENCY 0
+#define RADIO_IDLE_INTERVAL_US 40000
+#define RADIO_IDLE_LATENCY 4
+#define RADIO_SUP_TIMEOUT_US 3000000
+#define RADIO_LOCAL_MAX_US 400000
+
+/** nRF51822 的标称功耗 */
+#define RADIO_SLEEP_UA 2.6        /**< System ON，RTC 运行 */
+#define RADIO_EVENT_UC 7.0        /**< 一个只有空包的连接事件 */
+#define RADIO_PACKET_UC 1.0       /**< 每个数据包额外的电荷 */
+
+typedef enum
+{
+    RADIO_POLICY_FIXED,
+    RADIO_POLICY_PROFILE,
+    RADIO_POLICY_LOCAL,
+    RADIO_POLICY_COUNT
+} radio_policy_t;
+
+static const char * const radio_policy_name[RADIO_POLICY_COUNT] = { "fixed", "profile", "local" };
+
+/** 一次计算的结果，各起点的结果累加后取平均 */
+typedef struct
+{
+    double events;
+    double packets;
+    double typing_time;
+    double latency_sum;
+    double latency_max;
+    double first_count;
+    double first_sum;
+    double first_max;
+    double sent;
+} radio_result_t;
+
+static uint32_t radio_key[RADIO_MAX_RECORDS], radio_key_count;
+static uint32_t radio_report[RADIO_MAX_RECORDS], radio_report_count;
+
+static double ticks_to_us(uint32_t ticks)
+{
+    return (double)ticks * 1000000 / APP_TIMER_CLOCK_FREQ;
+}
+
+/**
+ * @brief 记录一次矩阵变化
+ */
+void sim_radio_key(void)
+{
+    if (radio_key_count < RADIO_MAX_RECORDS)
+        radio_key[radio_key_count++] = sim_timer_now();
+}
+
+/**
+ * @brief 记录一个交给协议栈的报告
+ */
+void sim_radio_report(void)
+{
+    if (radio_report_count < RADIO_MAX_RECORDS)
+        radio_report[radio_report_count++] = sim_timer_now();
+}
+
+/**
+ * @brief 监督超时的一半和 RADIO_LOCAL_MAX_US 以内、从机延迟整数倍的最大本地连接延迟，与协议栈的截短方式相同
+ */
+static uint32_t radio_local_latency(uint32_t interval, uint32_t latency)
+{
+    uint32_t limit = RADIO_LOCAL_MAX_US < RADIO_SUP_TIMEOUT_US / 2 ? RADIO_LOCAL_MAX_US : RADIO_SUP_TIMEOUT_US / 2;
+    uint32_t events = limit / interval - 1;
+    return latency ? events / latency * latency : 0;
+}
+
+/**
+ * @brief 从 start 开始按一个策略计算连接事件，结果累加到 result
+ */
+static void radio_run(radio_policy_t policy, double start, double end, bool verbose, radio_result_t * result)
+{
+    bool profile = policy != RADIO_POLICY_FIXED;
+    bool typing = false, update = false;
+    uint32_t interval = profile ? RADIO_IDLE_INTERVAL_US : RADIO_FIXED_INTERVAL_US;
+    uint32_t latency = profile ? RADIO_IDLE_LATENCY : RADIO_FIXED_LATENCY;
+    uint32_t local = policy == RADIO_POLICY_LOCAL ? radio_local_latency(interval, latency) : 0;
+    uint32_t update_events = 0, skipped = 0, key = 0, sent = 0, first_count = 0;
+    uint32_t events = 0, packets = 0;
+    double last_key = -1e12, typing_time = 0;
+    double latency_sum = 0, latency_max = 0, first_sum = 0, first_max = 0;
+
+    for (double t = start; t < end; t += interval)
+    {
+        // 打字开始时请求低延迟参数，并立即关闭本地连接延迟
+        for (; key < radio_key_count && ticks_to_us(radio_key[key]) < t; key++)
+        {
+            last_key = ticks_to_us(radio_key[key]);
+            if (profile && !typing)
+            {
+                typing = true;
+                update = true;
+                update_events = RADIO_UPDATE_EVENTS;
+                local = 0;
+            }
+        }
+        // 闲置后请求省电参数，由 1s 的睡眠计时器检查
+        if (profile && typing && t >= last_key + CONN_IDLE_TIMEOUT * 1000000.0)
+        {
+            typing = false;
+            update = true;
+            update_events = RADIO_UPDATE_EVENTS;
+        }
+        if (update && update_events-- == 0)
+        {
+            update = false;
+            interval = typing ? RADIO_TYPING_INTERVAL_US : RADIO_IDLE_INTERVAL_US;
+            latency = typing ? RADIO_TYPING_LATENCY : RADIO_IDLE_LATENCY;
+            if (policy == RADIO_POLICY_LOCAL && !typing)
+                local = radio_local_latency(interval, latency);
+        }
+        if (interval == RADIO_TYPING_INTERVAL_US)
+            typing_time += interval;
+
+        uint32_t pending = 0;
+        while (sent + pending < radio_report_count && ticks_to_us(radio_report[sent + pending]) <= t)
+            pending++;
+
+        if (pending == 0 && skipped < (local ? local : latency))
+        {
+            skipped++;
+            continue;
+        }
+        skipped = 0;
+        events++;
+        if (pending > RADIO_EVENT_PACKETS)
+            pending = RADIO_EVENT_PACKETS;
+        for (uint32_t i = 0; i < pending; i++, sent++)
+        {
+            double report = ticks_to_us(radio_report[sent]);
+            double delay = t - report;
+
+            latency_sum += delay;
+            latency_max = delay > latency_max ? delay : latency_max;
+            if (sent == 0 || report - ticks_to_us(radio_report[sent - 1]) > RADIO_FIRST_KEY_GAP_US)
+            {
+                first_count++;
+                first_sum += delay;
+                first_max = delay > first_max ? delay : first_max;
+            }
+            packets++;
+        }
+        if (verbose)
+            printf("radio %s %.1fms interval=%ums latency=%u local=%u packets=%u\n", radio_policy_name[policy],
+                   t / 1000, interval / 1000, latency, local, pending);
+    }
+
+    result->events += events;
+    result->packets += packets;
+    result->typing_time += typing_time;
+    result->latency_sum += latency_sum;
+    result->latency_max = latency_max > result->latency_max ? latency_max : result->latency_max;
+    result->first_count += first_count;
+    result->first_sum += first_sum;
+    result->first_max = first_max > result->first_max ? first_max : result->first_max;
+    result->sent += sent;
+}
+
+/**
+ * @brief 按一个策略从各个起点计算，输出平均值；最大延迟取所有起点中的最大值
+ */
+static void radio_print(radio_policy_t policy, double end, bool verbose)
+{
+    const char * name = radio_policy_name[policy];
+    radio_result_t r = { 0 };
+
+    for (uint32_t p = 0; p < RADIO_PHASES; p++)
+        radio_run(policy, (double)RADIO_FIXED_INTERVAL_US * p / RADIO_PHASES, end, verbose && p == 0, &r);
+
+    printf("%s_radio_events=%.0f\n", name, r.events / RADIO_PHASES);
+    printf("%s_radio_typing_s=%.1f\n", name, r.typing_time / RADIO_PHASES / 1000000);
+    printf("%s_radio_avg_ua=%.1f\n", name, RADIO_SLEEP_UA + (r.events * RADIO_EVENT_UC + r.packets * RADIO_PACKET_UC) / RADIO_PHASES / (end / 1000000));
+    if (r.sent)
+    {
+        printf("%s_radio_latency_ms_avg=%.1f\n", name, r.latency_sum / r.sent / 1000);
+        printf("%s_radio_latency_ms_max=%.1f\n", name, r.latency_max / 1000);
+    }
+    if (r.first_count)
+    {
+        printf("%s_radio_first_key_ms_avg=%.1f\n", name, r.first_sum / r.first_count / 1000);
+        printf("%s_radio_first_key_ms_max=%.1f\n", name, r.first_max / 1000);
+    }
+    printf("%s_radio_unsent=%.0f\n", name, radio_report_count - r.sent / RADIO_PHASES);
+}
+
+/**
+ * @brief 按各策略计算射频的连接事件数、平均电流和报告的发送延迟
+ *
+ * @param verbose 同时输出第一个起点的每个醒来的连接事件
+ */
+void sim_radio_print(bool verbose)
+{
+    double end = ticks_to_us(sim_timer_now());
+
+    printf("radio_reports=%u\n", radio_report_count);
+    printf("radio_duration_s=%.1f\n", end / 1000000);
+    for (uint8_t p = 0; p < RADIO_POLICY_COUNT; p++)
+        radio_print((radio_policy_t)p, end, verbose);
+}
@@ -0,0 +1,167 @@
+/**
+ * @brief 模拟 app_timer 与 app_scheduler
+ *
+ * 计数器与 RTC1 一样是 24 位、32768Hz，只有调用 sim_timer_advance() 时才前进，
+ * 到期的定时器在前进过程中按时间顺序同步调用。
+ * 中断中放入调度器的事件由 app_sched_execute() 在主循环中执行。
+ *
+ * @file sim_timer.c
+ */
+#include <stddef.h>
+#include <string.h>
+#include "app_timer.h"
+#include "app_scheduler.h"
+#include "app_util.h"
+#include "sim.h"
+
+#define MAX_TIMERS 16
+#define RTC_COUNTER_MASK 0x00FFFFFF
+#define SCHED_QUEUE_SIZE 16
+#define SCHED_EVENT_DATA_SIZE 16
+
+typedef struct
+{
+    app_timer_timeout_handler_t handler;
+    void * p_context;
+    uint32_t expire;
+    uint32_t period;
+    app_timer_mode_t mode;
+    bool running;
+} sim_timer_node_t;
+
+STATIC_ASSERT(sizeof(sim_timer_node_t) <= sizeof(app_timer_t));
+
+static sim_timer_node_t * timers[MAX_TIMERS];
+static uint8_t timer_count;
+static uint32_t now;
+
+typedef struct
+{
+    app_sched_event_handler_t handler;
+    uint16_t size;
+    uint8_t data[SCHED_EVENT_DATA_SIZE];
+} sim_sched_event_t;
+
+static sim_sched_event_t sched_queue[SCHED_QUEUE_SIZE];
+static uint8_t sched_head, sched_tail;
+
+uint32_t app_timer_create(app_timer_id_t const * p_timer_id,
+                          app_timer_mode_t mode,
+                          app_timer_timeout_handler_t timeout_handler)
+{
+    if (p_timer_id == NULL || timeout_handler == NULL)
+        return NRF_ERROR_INVALID_PARAM;
+    if (timer_count >= MAX_TIMERS)
+        return NRF_ERROR_NO_MEM;
+
+    sim_timer_node_t * node = (sim_timer_node_t *)*p_timer_id;
+    node->handler = timeout_handler;
+    node->mode = mode;
+    node->running = false;
+    timers[timer_count++] = node;
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_start(app_timer_id_t timer_id, uint32_t timeout_ticks, void * p_context)
+{
+    sim_timer_node_t * node = (sim_timer_node_t *)timer_id;
+    if (node->handler == NULL)
+        return NRF_ERROR_INVALID_STATE;
+    if (timeout_ticks < APP_TIMER_MIN_TIMEOUT_TICKS)
+        return NRF_ERROR_INVALID_PARAM;
+
+    node->p_context = p_context;
+    node->period = timeout_ticks;
+    node->expire = now + timeout_ticks;
+    node->running = true;
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_stop(app_timer_id_t timer_id)
+{
+    ((sim_timer_node_t *)timer_id)->running = false;
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_stop_all(void)
+{
+    for (uint8_t i = 0; i < timer_count; i++)
+        timers[i]->running = false;
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_cnt_get(uint32_t * p_ticks)
+{
+    *p_ticks = now & RTC_COUNTER_MASK;
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_cnt_diff_compute(uint32_t ticks_to, uint32_t ticks_from, uint32_t * p_ticks_diff)
+{
+    *p_ticks_diff = (ticks_to - ticks_from) & RTC_COUNTER_MASK;
+    return NRF_SUCCESS;
+}
+
+/**
+ * @brief 模拟时间前进，并依次触发期间到期的定时器
+ *
+ * @param ticks RTC tick 数
+ */
+void sim_timer_advance(uint32_t ticks)
+{
+    uint32_t target = now + ticks;
+
+    for (;;)
+    {
+        sim_timer_node_t * next = NULL;
+        for (uint8_t i = 0; i < timer_count; i++)
+        {
+            sim_timer_node_t * node = timers[i];
+            if (node->running && (int32_t)(node->expire - target) <= 0 &&
+                (next == NULL || (int32_t)(node->expire - next->expire) < 0))
+                next = node;
+        }
+        if (next == NULL)
+            break;
+
+        now = next->expire;
+        if (next->mode == APP_TIMER_MODE_REPEATED)
+            next->expire += next->period;
+        else
+            next->running = false;
+        next->handler(next->p_context);
+    }
+    now = target;
+}
+
+uint32_t sim_timer_now(void)
+{
+    return now;
+}
+
+uint32_t app_sched_event_put(void * p_event_data, uint16_t event_size, app_sched_event_handler_t handler)
+{
+    uint8_t next = (sched_tail + 1) % SCHED_QUEUE_SIZE;
+
+    if (event_size > SCHED_EVENT_DATA_SIZE)
+        return NRF_ERROR_INVALID_LENGTH;
+    if (next == sched_head)
+        return NRF_ERROR_NO_MEM;
+
+    sched_queue[sched_tail].handler = handler;
+    sched_queue[sched_tail].size = event_size;
+    if (p_event_data != NULL && event_size)
+        memcpy(sched_queue[sched_tail].data, p_event_data, event_size);
+    sched_tail = next;
+    return NRF_SUCCESS;
+}
+
+void app_sched_execute(void)
+{
+    while (sched_head != sched_tail)
+    {
+        sim_sched_event_t * evt = &sched_queue[sched_head];
+        sched_head = (sched_head + 1) % SCHED_QUEUE_SIZE;
+        evt->handler(evt->size ? evt->data : NULL, evt->size);
+    }
+}
@@ -0,0 +1,10 @@
+#ifndef __CRC_H__
+#define __CRC_H__
+
+#include <stdint.h>
+
+#define CRC16_INIT 0xFFFF
+
+uint16_t crc16(uint16_t crc, uint8_t *data, uint8_t len) __reentrant;
+
+#endif // __CRC_H__
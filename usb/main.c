@@ -13,6 +13,7 @@
 bool usb_evt = false;
 bool usb_sleep = false;
 bool ping_skip_next = false;
+static volatile bool ep3_paused = false;
 
 /**
  * @brief CH554 软复位
@@ -95,15 +96,15 @@ void KeyboardExtraUpload(uint8_t *packet, uint8_t len)
  * @brief 响应KeyMap下载数据包
  *
  * @param packet 数据包
- * @param len 长度
+ * @param len 长度，最长 7
  */
 void ResponseConfigurePacket(uint8_t *packet, uint8_t len)
 {
-    if (len > 64)
+    if (len > 7)
         return;
     Ep3Buffer[64] = 0x3f; // packet id
     memcpy(&Ep3Buffer[65], packet, len);
-    UEP3_T_LEN = 5;
+    UEP3_T_LEN = 8;
     UEP3_CTRL = UEP3_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_ACK;
 }
 
@@ -118,6 +119,10 @@ static void UARTInterrupt(void) __interrupt INT_NO_UART1
         uart_recv();
         // U1RI = 0;
     }
+    if (U1TI)
+    {
+        uart_tx_isr();
+    }
 }
 
 /**
@@ -126,13 +131,29 @@ static void UARTInterrupt(void) __interrupt INT_NO_UART1
  */
 void EP3_OUT()
 {
-    uint8_t checksum = 0x00;
-    for (int i = 1; i < 62; i++)
+    uart_send(PACKET_KEYMAP, &Ep3Buffer[1], 61);
+    // 发送缓冲区放不下下一个包时暂停接收，由 Ep3FlowControl 恢复
+    if (uart_tx_free() < UART_FRAME_MAX)
+    {
+        UEP3_CTRL = UEP3_CTRL & ~MASK_UEP_R_RES | UEP_R_RES_NAK;
+        ep3_paused = true;
+    }
+}
+
+/**
+ * @brief 发送缓冲区有空间后恢复端点3的接收
+ *
+ */
+static void Ep3FlowControl()
+{
+    if (ep3_paused && uart_tx_free() >= UART_FRAME_MAX)
     {
-        checksum += Ep3Buffer[i];
+        ep3_paused = false;
+        __critical
+        {
+            UEP3_CTRL = UEP3_CTRL & ~MASK_UEP_R_RES | UEP_R_RES_ACK;
+        }
     }
-    Ep3Buffer[62] = checksum;
-    uart_send(PACKET_KEYMAP, &Ep3Buffer[1], 62);
 }
 
 /**
@@ -234,5 +255,7 @@ static void main()
     while (1)
     {
         timer_task_exec();
+        uart_task();
+        Ep3FlowControl();
     }
 }
@@ -2,50 +2,152 @@
 #include "CH554_SDCC.h"
 #include "usb_comm.h"
 #include "system.h"
+#include "crc.h"
 #include <stdbool.h>
 
 #define CHARGING UCC1
 #define STANDBY UCC2
 
 uart_state uart_rx_state;
-static uint8_t len, pos;
+static uint8_t len;
 static uint8_t __xdata recv_buff[64];
 static packet_type send_type;
 
-static bool uart_check_flag, uart_arrive_flag;
+static bool uart_check_flag;
 
-static void uart_tx(uint8_t c)
+/**
+ * 接收缓冲区，必须是 2 的幂。
+ * 单生产者单消费者：串口中断只写 rx_tail 和 rx_commit，主循环只写 rx_head，
+ * 都是单字节变量，不需要关中断。
+ * 每个包按收到的原样（长度字节 + 内容）存放，收完整个包后才移动 rx_commit 提交给主循环。
+ */
+#define UART_RX_BUFF_SIZE 128
+#define UART_RX_MASK (UART_RX_BUFF_SIZE - 1)
+static uint8_t __xdata rx_buff[UART_RX_BUFF_SIZE];
+static volatile uint8_t rx_head, rx_tail, rx_commit;
+// 当前包还没收到的字节数，以及当前包是否因为放不下而要丢弃
+static uint8_t rx_remain;
+static bool rx_overflow;
+static uint8_t rx_dropped_seen;
+
+volatile uint8_t uart_rx_dropped;
+
+#define UART_BAUD(baud) (256 - FREQ_SYS / 16 / (baud))
+/**
+ * 可用的波特率，序号与 nRF51 一侧的 uart_baud_rates 对应。
+ * 12MHz 下 250000 可以精确分频，115200 误差太大不能使用。
+ */
+static const uint8_t __code baud_table[] = {UART_BAUD(57600), UART_BAUD(250000)};
+#define BAUD_COUNT (sizeof(baud_table) / sizeof(baud_table[0]))
+// 非默认波特率下这么久（ms）没有收到正确的包，回到默认波特率。nRF51 每 1.5s 检查一次连接
+#define BAUD_WATCHDOG 2000
+// 连续收到这么多错误的包，回到默认波特率
+#define BAUD_ERROR_LIMIT 4
+
+static uint8_t baud_index, baud_errors;
+static uint16_t baud_watchdog;
+
+// 按键报告的重发窗口，与 nRF51 一侧的 UART_REPORT_WINDOW 相同
+#define REPORT_WINDOW 16
+// 期待的下一个报告序号
+static uint8_t report_next;
+// 是否要在这一轮处理结束后发送确认；是否已经为当前缺失的报告发送过确认
+static bool report_ack_pending, report_nak_sent;
+
+// 发送缓冲区，必须是 2 的幂。能放下两个 keymap 包
+#define UART_TX_BUFF_SIZE 128
+#define UART_TX_MASK (UART_TX_BUFF_SIZE - 1)
+static uint8_t __xdata tx_buff[UART_TX_BUFF_SIZE];
+// 头尾指针自由增长，访问时取模，head == tail 表示空
+static volatile uint8_t tx_head, tx_tail;
+static volatile bool tx_busy, baud_apply;
+
+uint16_t uart_tx_queued, uart_tx_dropped;
+uint8_t uart_tx_peak;
+
+static void uart_set_baud(uint8_t index)
+{
+    baud_index = index;
+    baud_errors = 0;
+    baud_watchdog = BAUD_WATCHDOG;
+    // 还有数据没发完时等发送中断发完最后一个字节再切换
+    __critical
+    {
+        if (tx_busy)
+            baud_apply = true;
+        else
+            SBAUD1 = baud_table[index];
+    }
+}
+
+/**
+ * @brief 串口发送中断，发送缓冲区中的下一个字节
+ */
+void uart_tx_isr(void)
 {
-    SBUF1 = c;
-    while (U1TI == 0)
-        ;
     U1TI = 0;
+    if (tx_head != tx_tail)
+    {
+        SBUF1 = tx_buff[tx_head++ & UART_TX_MASK];
+    }
+    else
+    {
+        tx_busy = false;
+        if (baud_apply)
+        {
+            baud_apply = false;
+            SBAUD1 = baud_table[baud_index];
+        }
+    }
 }
 
-static uint8_t uart_rx()
+/**
+ * @brief 发送缓冲区剩余空间
+ */
+uint8_t uart_tx_free(void)
 {
-    while (U1RI == 0)
-        ;
-    U1RI = 0;
-    return SBUF1;
+    return UART_TX_BUFF_SIZE - (uint8_t)(tx_tail - tx_head);
 }
 
-static void uart_ack()
+/**
+ * @brief 检查报告序号
+ *
+ * @return 是否是期待的下一个报告。重复的报告只确认不上传，
+ *         跳过了序号的报告丢弃，并立即确认一次让 nRF51 重发
+ */
+static bool report_check(uint8_t seq)
 {
-    uart_send(PACKET_ACK, 0, 0);
+    if (seq == report_next)
+    {
+        report_next++;
+        report_nak_sent = false;
+        report_ack_pending = true;
+        return true;
+    }
+    if ((uint8_t)(report_next - seq) <= REPORT_WINDOW)
+    {
+        report_ack_pending = true;
+    }
+    else if (!report_nak_sent)
+    {
+        report_nak_sent = true;
+        report_ack_pending = true;
+    }
+    return false;
 }
 static void uart_fail()
 {
     uart_send(PACKET_FAIL, 0, 0);
+    if (baud_index && ++baud_errors >= BAUD_ERROR_LIMIT)
+        uart_set_baud(0);
 }
 
-static uint8_t checksum()
+/**
+ * @brief 校验带数据的包，包括类型在内计算 CRC，结果为 0 表示正确
+ */
+static bool crc_check()
 {
-    uint8_t sum = 0x00;
-
-    for (int i = 1; i < len - 1; i++)
-        sum += recv_buff[i];
-    return sum == recv_buff[len - 1];
+    return crc16(CRC16_INIT, recv_buff, len) == 0;
 }
 
 void uart_init()
@@ -53,8 +155,9 @@ void uart_init()
     U1SM0 = 0;  // 8Bit
     U1SMOD = 1; // fast mode
     U1REN = 1;  //串口0接收使能
-    SBAUD1 = 256 - FREQ_SYS / 16 / 57600;
+    uart_set_baud(0);
     IE_UART1 = 1; //启用串口中断
+    IP_EX |= bIP_UART1; // 在 USB 中断中发送 keymap 包时也要接收下载状态
 }
 
 static void uart_data_parser(void)
@@ -68,34 +171,66 @@ static void uart_data_parser(void)
             ResponseConfigurePacket(recv_buff, 1);
         }
         break;
-    case PACKET_KEYBOARD:
-        if (checksum())
+    case PACKET_KEYMAP_ACK:
+        // 下载状态，校验失败时丢弃，上位机超时后重发
+        if (crc_check())
         {
-            KeyboardGenericUpload(&recv_buff[1], len - 2);
-            uart_ack();
+            ResponseConfigurePacket(recv_buff, len - 2);
         }
-        else
+        break;
+    case PACKET_KEYBOARD:
+        if (!crc_check())
         {
             uart_fail();
+            return;
         }
-
+        if (report_check(recv_buff[1]))
+            KeyboardGenericUpload(&recv_buff[2], len - 4);
         break;
     case PACKET_SYSTEM:
-        // 使用type位置暂存一下ID
-        recv_buff[0] = 2;
-        KeyboardExtraUpload(recv_buff, 3);
-        uart_ack();
-        break;
     case PACKET_COMSUMER:
-        recv_buff[0] = 3;
-        KeyboardExtraUpload(recv_buff, 3);
-        uart_ack();
+        if (!crc_check())
+        {
+            uart_fail();
+            return;
+        }
+        if (report_check(recv_buff[1]))
+        {
+            // 使用序号位置暂存一下ID
+            recv_buff[1] = recv_buff[0] == PACKET_SYSTEM ? 2 : 3;
+            KeyboardExtraUpload(&recv_buff[1], 3);
+        }
+        break;
+    case PACKET_REPORT_SYNC:
+        if (!crc_check())
+        {
+            uart_fail();
+            return;
+        }
+        // 不强制时不回退，已经上传过的报告不再上传
+        if (recv_buff[2] || (uint8_t)(report_next - recv_buff[1]) > REPORT_WINDOW)
+            report_next = recv_buff[1];
+        report_nak_sent = false;
+        report_ack_pending = true;
         break;
     case PACKET_GET_STATE:
         recv_buff[0] = CHARGING;
         uart_send(PACKET_CHARGING, recv_buff, 1);
         break;
+    case PACKET_SET_BAUD:
+        if (!crc_check())
+        {
+            uart_fail();
+            return;
+        }
+        // 先用当前的波特率应答，发送完毕后再切换
+        recv_buff[0] = recv_buff[1] < BAUD_COUNT ? recv_buff[1] : baud_index;
+        uart_send(PACKET_BAUD, recv_buff, 1);
+        uart_set_baud(recv_buff[0]);
+        break;
     }
+    baud_errors = 0;
+    baud_watchdog = BAUD_WATCHDOG;
 }
 
 static bool length_check(void)
@@ -103,45 +238,94 @@ static bool length_check(void)
     switch ((packet_type)recv_buff[0])
     {
     case PACKET_KEYBOARD:
-        return len == 10;
+        return len == 12;
     case PACKET_SYSTEM:
     case PACKET_COMSUMER:
+        return len == 6;
+    case PACKET_REPORT_SYNC:
+        return len == 5;
+    case PACKET_SET_BAUD:
         return len == 4;
     case PACKET_GET_STATE:
     case PACKET_FAIL:
     case PACKET_ACK:
         return len == 1;
+    case PACKET_KEYMAP_ACK:
+        return len == 9;
     default:
         return false;
     }
 }
 
+/**
+ * @brief 丢弃正在接收的包
+ */
+static void uart_rx_abort(void)
+{
+    uart_rx_state = STATE_IDLE;
+    rx_tail = rx_commit;
+}
+
 void uart_check()
 {
-    if (uart_check_flag)
+    if (baud_index && --baud_watchdog == 0)
+        uart_set_baud(0);
+
+    if (uart_check_flag && uart_rx_state == STATE_DATA)
     {
-        if (uart_rx_state == STATE_DATA)
+        // 接收超时，丢弃收到一半的包
+        __critical
         {
-            // 接收超时强制退出并请求重发
-            uart_rx_state = STATE_IDLE;
-            // uart_fail();
+            uart_rx_abort();
         }
-        else if ((uart_rx_state == STATE_IDLE) && uart_arrive_flag)
+    }
+    uart_check_flag = true;
+}
+
+/**
+ * @brief 处理接收缓冲区中所有完整的包，在主循环中调用
+ */
+void uart_task(void)
+{
+    uint8_t i;
+
+    while (rx_head != rx_commit)
+    {
+        len = rx_buff[rx_head & UART_RX_MASK];
+        for (i = 0; i < len; i++)
+            recv_buff[i] = rx_buff[(uint8_t)(rx_head + 1 + i) & UART_RX_MASK];
+        // 复制完再释放空间
+        rx_head += len + 1;
+
+        if (length_check())
         {
-            uart_arrive_flag = false;
-            if (length_check())
-            {
-                uart_data_parser();
-            }
-            else
-            {
-                uart_fail();
-            }
+            uart_data_parser();
+        }
+        else
+        {
+            uart_fail();
         }
     }
-    uart_check_flag = true;
+
+    // 这一轮收到的所有报告只确认一次
+    if (report_ack_pending)
+    {
+        report_ack_pending = false;
+        recv_buff[0] = report_next;
+        uart_send(PACKET_REPORT_ACK, recv_buff, 1);
+    }
+
+    if (rx_dropped_seen != uart_rx_dropped)
+    {
+        // 有包因为缓冲区满被丢弃，请求重发
+        rx_dropped_seen = uart_rx_dropped;
+        uart_fail();
+    }
 }
 
+/**
+ * @brief 串口接收中断，把收到的字节放入接收缓冲区
+ */
 void uart_recv(void)
 {
     /**
@@ -150,34 +334,100 @@ void uart_recv(void)
      * Variable:
      *     len  buf[0] buf[1]  ... Buf[Len-1]
      */
-    switch (uart_rx_state)
+    uint8_t c;
+
+    U1RI = 0;
+    c = SBUF1;
+    uart_check_flag = false;
+
+    if (uart_rx_state == STATE_IDLE)
     {
-    case STATE_IDLE:
-        len = uart_rx();
-        pos = 0;
-        if (len > 0) // Len=0 意味着出错了，别管它
-            uart_rx_state = STATE_DATA;
-        break;
+        if (c == 0) // Len=0 意味着出错了，别管它
+            return;
+        rx_remain = c;
+        // 放不进 recv_buff 的包收完后直接丢弃
+        rx_overflow = c > sizeof(recv_buff);
+        uart_rx_state = STATE_DATA;
+    }
+    else
+    {
+        rx_remain--;
+    }
+
+    if ((uint8_t)(rx_tail - rx_head) >= UART_RX_BUFF_SIZE)
+        rx_overflow = true;
+    else
+        rx_buff[rx_tail++ & UART_RX_MASK] = c;
 
-    case STATE_DATA:
-        recv_buff[pos++] = uart_rx();
-        if (pos >= len)
+    if (rx_remain == 0)
+    {
+        if (rx_overflow)
+        {
+            uart_rx_dropped++;
+            uart_rx_abort();
+        }
+        else
         {
             uart_rx_state = STATE_IDLE;
-            uart_arrive_flag = true;
+            rx_commit = rx_tail;
         }
-        break;
     }
-    uart_check_flag = false;
 }
 
-void uart_send(packet_type type, uint8_t *data, uint8_t len)
+/**
+ * @brief 将数据包放入发送缓冲区，立即返回
+ *
+ * 有数据的包在最后附加类型和数据的 CRC，高字节在前。
+ * 缓冲区放不下整个包时丢弃整个包，避免对端收到半个包。
+ *
+ * 主循环和 USB 中断都会调用。没有 --stack-auto 时局部变量和参数是静态分配的，
+ * 所以声明为 __reentrant，放在栈上，中断中的调用不会改写主循环正在计算的 CRC 和长度。
+ *
+ * @return 是否成功放入
+ */
+bool uart_send(packet_type type, uint8_t *data, uint8_t len) __reentrant
 {
-    send_type = type;
-    uart_tx(len + 1);
-    uart_tx(type);
-    while (len--)
+    uint8_t size = len ? len + 4 : 2;
+    uint8_t head = type;
+    uint16_t crc = 0;
+    bool queued = false;
+
+    if (len)
+        crc = crc16(crc16(CRC16_INIT, &head, 1), data, len);
+
+    // 关中断避免两者交错写入缓冲区
+    __critical
     {
-        uart_tx(*(data++));
+        if (uart_tx_free() < size)
+        {
+            uart_tx_dropped += size;
+        }
+        else
+        {
+            send_type = type;
+            tx_buff[tx_tail++ & UART_TX_MASK] = size - 1;
+            tx_buff[tx_tail++ & UART_TX_MASK] = type;
+            if (len)
+            {
+                while (len--)
+                {
+                    tx_buff[tx_tail++ & UART_TX_MASK] = *(data++);
+                }
+                tx_buff[tx_tail++ & UART_TX_MASK] = crc >> 8;
+                tx_buff[tx_tail++ & UART_TX_MASK] = crc;
+            }
+            uart_tx_queued += size;
+            size = tx_tail - tx_head;
+            if (size > uart_tx_peak)
+                uart_tx_peak = size;
+
+            if (!tx_busy)
+            {
+                tx_busy = true;
+                SBUF1 = tx_buff[tx_head++ & UART_TX_MASK];
+            }
+            queued = true;
+        }
     }
+    return queued;
 }
@@ -2,6 +2,7 @@
 #define __UART__DRIVER__
 
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef enum
 {
@@ -11,22 +12,33 @@ typedef enum
     PACKET_CHARGING,
     PACKET_KEYMAP,
     PACKET_USB_STATE,
+    PACKET_BAUD,
 
     // uart tx
     PACKET_KEYBOARD = 0x80,
     PACKET_SYSTEM,
     PACKET_COMSUMER,
     PACKET_GET_STATE,
+    PACKET_SET_BAUD,
+    PACKET_REPORT_SYNC,
 
     // uart other
     PACKET_FAIL = 0xc0,
     PACKET_ACK,
+    PACKET_KEYMAP_ACK,
+    PACKET_REPORT_ACK,
 } packet_type;
 
-void uart_send(packet_type type, uint8_t *data, uint8_t len);
+// 最长的包：长度 类型 keymap 数据[61] CRC[2]
+#define UART_FRAME_MAX 65
+
+bool uart_send(packet_type type, uint8_t *data, uint8_t len) __reentrant;
 void uart_recv(void);
+void uart_tx_isr(void);
+uint8_t uart_tx_free(void);
 void uart_init(void);
 void uart_check(void);
+void uart_task(void);
 
 typedef enum
 {
@@ -36,4 +48,10 @@ typedef enum
 
 extern uart_state uart_rx_state;
 
+// 发送统计：放入缓冲区和因缓冲区满丢弃的字节数，缓冲区最大占用
+extern uint16_t uart_tx_queued, uart_tx_dropped;
+extern uint8_t uart_tx_peak;
+// 因为接收缓冲区满或包太长而丢弃的包数
+extern volatile uint8_t uart_rx_dropped;
+
 #endif // __UART__DRIVER__
@@ -337,7 +337,7 @@ uint8_t const report_desc_HID2[]=
     0x09, 0x01,    // Usage Page (Vendor Defined)
     0xa1, 0x01,    // COLLECTION (Application)
     0x85, 0x3f,    // Report ID (Vendor Defined)
-    0x95, 0x04,    // Report Count
+    0x95, 0x07,    // Report Count
     0x75, 0x08,    // Report Size
     0x25, 0x01,    // Usage Maximum
     0x15, 0x01,    // Usage Minimum